@@ -0,0 +1,92 @@
+/* RP2040 GameBoy cartridge
+ * Copyright (C) 2024 Sebastian Quilitz
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "BusTrace.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if GB_BUS_TRACE
+
+#define BUS_TRACE_MAGIC 0x42545243U
+
+_Static_assert((GB_BUS_TRACE_ENTRIES & (GB_BUS_TRACE_ENTRIES - 1)) == 0,
+               "GB_BUS_TRACE_ENTRIES needs to be a power of 2");
+_Static_assert(sizeof(struct BusTraceEntry) == 8,
+               "the trace format expects 8 byte entries");
+
+struct BusTrace __attribute__((section(".noinit."))) g_busTrace;
+
+void BusTrace_Start() {
+  g_busTrace.count = 0;
+  g_busTrace.magic = BUS_TRACE_MAGIC;
+}
+
+void BusTrace_PrintSummary() {
+  if (g_busTrace.magic != BUS_TRACE_MAGIC) {
+    return;
+  }
+
+  printf("Bus trace with %u writes available (%u kept)\n", g_busTrace.count,
+         g_busTrace.count < GB_BUS_TRACE_ENTRIES ? g_busTrace.count
+                                                 : GB_BUS_TRACE_ENTRIES);
+}
+
+int BusTrace_ReadEntries(uint32_t first, uint8_t *buffer, size_t maxEntries,
+                         uint32_t *total) {
+  if (g_busTrace.magic != BUS_TRACE_MAGIC) {
+    return -1;
+  }
+
+  const uint32_t count = g_busTrace.count;
+  const uint32_t kept =
+      count < GB_BUS_TRACE_ENTRIES ? count : GB_BUS_TRACE_ENTRIES;
+  const uint32_t oldest = count - kept;
+
+  *total = kept;
+
+  if (first >= kept) {
+    return 0;
+  }
+
+  if (maxEntries > (kept - first)) {
+    maxEntries = kept - first;
+  }
+
+  for (size_t i = 0; i < maxEntries; i++) {
+    const uint32_t index = (oldest + first + i) & (GB_BUS_TRACE_ENTRIES - 1);
+    memcpy(&buffer[i * sizeof(struct BusTraceEntry)],
+           &g_busTrace.entries[index], sizeof(struct BusTraceEntry));
+  }
+
+  return maxEntries;
+}
+
+#else
+
+void BusTrace_Start() {}
+
+void BusTrace_PrintSummary() {}
+
+int BusTrace_ReadEntries(uint32_t first, uint8_t *buffer, size_t maxEntries,
+                         uint32_t *total) {
+  return -1;
+}
+
+#endif
@@ -0,0 +1,86 @@
+/* RP2040 GameBoy cartridge
+ * Copyright (C) 2024 Sebastian Quilitz
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef F3B1C7E2_5A4D_4C8E_9E21_7B6D0A3F9C14
+#define F3B1C7E2_5A4D_4C8E_9E21_7B6D0A3F9C14
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <hardware/structs/timer.h>
+
+/*
+ * Trace of the writes the GameBoy does on the bus, recorded by the MBC loops.
+ * The trace is kept in noinit RAM so it survives the reset which is needed to
+ * leave the game and can be downloaded over WebUSB afterwards. USB can not run
+ * while a game is running, as the flash is in direct SSI mode then.
+ *
+ * Each entry is 8 bytes, little endian:
+ *   uint32_t timestampUs  lower 32 bits of the microsecond timer
+ *   uint16_t addr         address on the GameBoy bus
+ *   uint8_t  data         data written to addr
+ *   uint8_t  flags        BUS_TRACE_FLAG_*
+ */
+
+#define BUS_TRACE_FLAG_WRITE 0x01U
+
+struct BusTraceEntry {
+  uint32_t timestampUs;
+  uint16_t addr;
+  uint8_t data;
+  uint8_t flags;
+};
+
+#if GB_BUS_TRACE
+
+struct BusTrace {
+  uint32_t magic;
+  uint32_t count;
+  struct BusTraceEntry entries[GB_BUS_TRACE_ENTRIES];
+};
+
+extern struct BusTrace g_busTrace;
+
+static inline void BusTrace_recordWrite(uint16_t addr, uint8_t data) {
+  struct BusTraceEntry *entry =
+      &g_busTrace.entries[g_busTrace.count & (GB_BUS_TRACE_ENTRIES - 1)];
+
+  entry->timestampUs = timer_hw->timerawl;
+  entry->addr = addr;
+  entry->data = data;
+  entry->flags = BUS_TRACE_FLAG_WRITE;
+  g_busTrace.count++;
+}
+
+#define BUS_TRACE_WRITE(addr, data) BusTrace_recordWrite(addr, data)
+#else
+#define BUS_TRACE_WRITE(addr, data)
+#endif
+
+void BusTrace_Start();
+void BusTrace_PrintSummary();
+
+/*
+ * Copies up to maxEntries entries starting at the oldest entry still in the
+ * ring plus first. Returns the number of copied entries, negative if there is
+ * no trace.
+ */
+int BusTrace_ReadEntries(uint32_t first, uint8_t *buffer, size_t maxEntries,
+                         uint32_t *total);
+
+#endif /* F3B1C7E2_5A4D_4C8E_9E21_7B6D0A3F9C14 */
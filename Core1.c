@@ -0,0 +1,125 @@
+/* RP2040 GameBoy cartridge
+ * Copyright (C) 2024 Sebastian Quilitz
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "Core1.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <hardware/structs/sio.h>
+#include <hardware/sync.h>
+#include <pico/multicore.h>
+#include <pico/platform.h>
+
+#include "GbRtc.h"
+#include "GlobalDefines.h"
+#include "ws2812b_spi.h"
+
+/*
+ * Core1 takes care of everything which is not time critical while a game is
+ * running, so core0 only needs to serve the bus. Core0 sends its requests
+ * through the SIO FIFO, which is a lock free queue with core0 as the only
+ * producer and core1 as the only consumer. Core1 only runs from RAM as the
+ * flash is not accessible through XIP while a game is running.
+ *
+ * Commands are one word, the command in the upper byte and the arguments in
+ * the lower bytes.
+ */
+#define CORE1_CMD_SET_RGB 1U
+#define CORE1_CMD_RTC_WRITE 2U
+#define CORE1_CMD_RTC_LATCH 3U
+
+#define CORE1_CMD(CMD, ARG) (((CMD) << 24) | ((ARG) & 0x00FFFFFFU))
+
+static volatile bool _core1Running = false;
+static bool _hasRtc = false;
+
+static void __no_inline_not_in_flash_func(handleCommand)(uint32_t command) {
+  switch (command >> 24) {
+  case CORE1_CMD_SET_RGB:
+    ws2812b_setRgb((command >> 16) & 0xFF, (command >> 8) & 0xFF,
+                   command & 0xFF);
+    break;
+  case CORE1_CMD_RTC_WRITE:
+    GbRtc_WriteRegister((command >> 8) & 0xFF, command & 0xFF);
+    break;
+  case CORE1_CMD_RTC_LATCH:
+    memcpy((void *)&g_rtcLatched, (void *)&g_rtcReal, sizeof(struct GbRtc));
+    break;
+  default:
+    break;
+  }
+}
+
+static void __no_inline_not_in_flash_func(core1Main)() {
+  while (1) {
+    if (_hasRtc) {
+      GbRtc_PerformRtcTick();
+    }
+
+    while (sio_hw->fifo_st & SIO_FIFO_ST_VLD_BITS) {
+      handleCommand(sio_hw->fifo_rd);
+    }
+  }
+}
+
+static void __no_inline_not_in_flash_func(pushCommand)(uint32_t command) {
+  while (!(sio_hw->fifo_st & SIO_FIFO_ST_RDY_BITS)) {
+    tight_loop_contents();
+  }
+  sio_hw->fifo_wr = command;
+}
+
+void Core1_Start(bool hasRtc) {
+  _hasRtc = hasRtc;
+
+  multicore_reset_core1();
+  multicore_launch_core1(core1Main);
+
+  _core1Running = true;
+}
+
+void __no_inline_not_in_flash_func(Core1_SetRgb)(uint8_t r, uint8_t g,
+                                                 uint8_t b) {
+  if (!_core1Running) {
+    ws2812b_setRgb(r, g, b);
+    return;
+  }
+
+  pushCommand(CORE1_CMD(CORE1_CMD_SET_RGB, (r << 16) | (g << 8) | b));
+}
+
+void __no_inline_not_in_flash_func(Core1_RtcWriteRegister)(uint8_t reg,
+                                                           uint8_t val) {
+  if (!_core1Running) {
+    GbRtc_WriteRegister(reg, val);
+    return;
+  }
+
+  pushCommand(CORE1_CMD(CORE1_CMD_RTC_WRITE, (reg << 8) | val));
+}
+
+void __no_inline_not_in_flash_func(Core1_RtcLatch)() {
+  if (!_core1Running) {
+    handleCommand(CORE1_CMD(CORE1_CMD_RTC_LATCH, 0));
+    return;
+  }
+
+  pushCommand(CORE1_CMD(CORE1_CMD_RTC_LATCH, 0));
+}
@@ -0,0 +1,31 @@
+/* RP2040 GameBoy cartridge
+ * Copyright (C) 2024 Sebastian Quilitz
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef E8E2D6B4_1C3F_4F7A_A5D9_2E7C4B1F0A63
+#define E8E2D6B4_1C3F_4F7A_A5D9_2E7C4B1F0A63
+
+#include <stdbool.h>
+#include <stdint.h>
+
+void Core1_Start(bool hasRtc);
+
+void Core1_SetRgb(uint8_t r, uint8_t g, uint8_t b);
+void Core1_RtcWriteRegister(uint8_t reg, uint8_t val);
+void Core1_RtcLatch();
+
+#endif /* E8E2D6B4_1C3F_4F7A_A5D9_2E7C4B1F0A63 */
@@ -0,0 +1,439 @@
+/* RP2040 GameBoy cartridge
+ * Copyright (C) 2024 Sebastian Quilitz
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <hardware/clocks.h>
+#include <hardware/flash.h>
+#include <hardware/regs/addressmap.h>
+#include <hardware/regs/ssi.h>
+#include <hardware/structs/ssi.h>
+#include <hardware/sync.h>
+#include <lfs_pico_hal.h>
+#include <lfs_util.h>
+#include <pico/platform.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "FlashSsi.h"
+
+#define TIMING_FILE "/flashtiming"
+#define TIMING_FILE_MAGIC 0x7157CA1CU
+
+/*
+ * The calibration reads a part of the firmware through the direct SSI path and
+ * compares it with the same data read through XIP with the boot settings.
+ */
+#define CALIBRATION_OFFSET 0x1000U
+#define CALIBRATION_SIZE 512U
+#define CALIBRATION_REPEATS 4U
+#define CALIBRATION_MIN_BAUDR 2U
+#define CALIBRATION_MAX_BAUDR 8U
+#define CALIBRATION_MAX_RX_SAMPLE_DELAY 7U
+
+struct FlashTimingFile {
+  uint32_t magic;
+  uint32_t sysClkKhz;
+  uint32_t bootBaudr;
+  uint32_t baudr;
+  uint32_t rxSampleDelay;
+  uint32_t crc;
+};
+
+// used as file buffer and to hold the reference data of the calibration
+static uint8_t _buffer[LFS_CACHE_SIZE];
+
+#define FLASH_CMD_READ_JEDEC_ID 0x9F
+#define FLASH_CMD_READ_STATUS1 0x05
+#define FLASH_CMD_READ_STATUS2 0x35
+#define FLASH_CMD_WRITE_STATUS 0x01
+#define FLASH_CMD_WRITE_ENABLE 0x06
+
+#define FLASH_STATUS1_BUSY 0x01
+#define FLASH_STATUS1_QE 0x40
+#define FLASH_STATUS2_QE 0x02
+
+/*
+ * Known flash chips. The first entry is used for unknown chips, it has the
+ * same settings as the W25Q080 boot stage 2.
+ */
+static const struct FlashSsiProfile _profiles[] = {
+    {
+        .name = "Winbond W25Q",
+        .manufacturerId = 0xEF,
+        .modeBits = 0xA0,
+        .waitCycles = 4,
+        .quadEnable = FLASH_QE_SR2_BIT1,
+    },
+    {
+        .name = "GigaDevice GD25Q",
+        .manufacturerId = 0xC8,
+        .modeBits = 0xA0,
+        .waitCycles = 4,
+        .quadEnable = FLASH_QE_SR2_BIT1,
+    },
+    {
+        .name = "Macronix MX25L",
+        .manufacturerId = 0xC2,
+        .modeBits = 0xA5, // performance enhance mode needs P7-4 != P3-0
+        .waitCycles = 4,
+        .quadEnable = FLASH_QE_SR1_BIT6,
+    },
+    {
+        .name = "ISSI IS25LP",
+        .manufacturerId = 0x9D,
+        .modeBits = 0xA0,
+        .waitCycles = 4,
+        .quadEnable = FLASH_QE_SR1_BIT6,
+    },
+};
+
+static const struct FlashSsiProfile *_profile = &_profiles[0];
+static uint32_t _flashSizeBytes = PICO_FLASH_SIZE_BYTES;
+
+uint32_t g_flashSsiSpiCtrlr0 = 0;
+uint32_t g_flashSsiBaudr = 0;
+uint32_t g_flashSsiRxSampleDelay = 0;
+
+static void flashCmd(const uint8_t *tx, uint8_t *rx, size_t count) {
+  const uint32_t interrupts = save_and_disable_interrupts();
+  flash_do_cmd(tx, rx, count);
+  restore_interrupts(interrupts);
+}
+
+static uint8_t readStatus(uint8_t cmd) {
+  const uint8_t tx[2] = {cmd, 0};
+  uint8_t rx[2] = {};
+  flashCmd(tx, rx, sizeof(tx));
+  return rx[1];
+}
+
+static void writeStatus(const uint8_t *status, size_t count) {
+  const uint8_t writeEnable = FLASH_CMD_WRITE_ENABLE;
+  uint8_t tx[3] = {FLASH_CMD_WRITE_STATUS};
+  uint8_t rx[3];
+
+  memcpy(&tx[1], status, count);
+
+  flashCmd(&writeEnable, rx, 1);
+  flashCmd(tx, rx, count + 1);
+
+  while (readStatus(FLASH_CMD_READ_STATUS1) & FLASH_STATUS1_BUSY) {
+    tight_loop_contents();
+  }
+}
+
+/*
+ * The boot stage 2 of a W25Q already set the QE bit, but other chips keep it
+ * somewhere else. It is only written if it is not set yet, as the status
+ * register is non-volatile.
+ */
+static void enableQuadMode() {
+  uint8_t status[2];
+
+  switch (_profile->quadEnable) {
+  case FLASH_QE_SR2_BIT1:
+    status[0] = readStatus(FLASH_CMD_READ_STATUS1);
+    status[1] = readStatus(FLASH_CMD_READ_STATUS2);
+    if (!(status[1] & FLASH_STATUS2_QE)) {
+      status[1] |= FLASH_STATUS2_QE;
+      writeStatus(status, 2);
+      printf("flash quad mode enabled\n");
+    }
+    break;
+
+  case FLASH_QE_SR1_BIT6:
+    status[0] = readStatus(FLASH_CMD_READ_STATUS1);
+    if (!(status[0] & FLASH_STATUS1_QE)) {
+      status[0] |= FLASH_STATUS1_QE;
+      writeStatus(status, 1);
+      printf("flash quad mode enabled\n");
+    }
+    break;
+
+  default:
+    break;
+  }
+}
+
+static void detectFlash() {
+  const uint8_t tx[4] = {FLASH_CMD_READ_JEDEC_ID};
+  uint8_t rx[4] = {};
+
+  flashCmd(tx, rx, sizeof(tx));
+  printf("flash JEDEC ID %02x %02x %02x\n", rx[1], rx[2], rx[3]);
+
+  for (size_t i = 0; i < count_of(_profiles); i++) {
+    if (_profiles[i].manufacturerId == rx[1]) {
+      _profile = &_profiles[i];
+      break;
+    }
+  }
+
+  // capacity is given as a power of two
+  if ((rx[3] >= 0x10) && (rx[3] < 0x20)) {
+    _flashSizeBytes = 1U << rx[3];
+  }
+
+  /*
+   * The direct SSI path sends address and mode bits as a single 32 bit word,
+   * so there is no room for a 4 byte address. Bigger chips stay in 3 byte
+   * address mode and only the lower 16MB are used.
+   */
+  if (_flashSizeBytes > (16U * 1024U * 1024U)) {
+    _flashSizeBytes = 16U * 1024U * 1024U;
+  }
+
+  if (_flashSizeBytes < PICO_FLASH_SIZE_BYTES) {
+    printf("flash is smaller than the expected %d bytes\n",
+           PICO_FLASH_SIZE_BYTES);
+  }
+}
+
+void FlashSsi_Init() {
+  detectFlash();
+  enableQuadMode();
+
+  g_flashSsiSpiCtrlr0 =
+      (_profile->modeBits << SSI_SPI_CTRLR0_XIP_CMD_LSB) |
+      (8 << SSI_SPI_CTRLR0_ADDR_L_LSB) | /* 24 address + 8 mode bits */
+      (_profile->waitCycles << SSI_SPI_CTRLR0_WAIT_CYCLES_LSB) |
+      (SSI_SPI_CTRLR0_INST_L_VALUE_NONE /* no instruction */
+       << SSI_SPI_CTRLR0_INST_L_LSB) |
+      (SSI_SPI_CTRLR0_TRANS_TYPE_VALUE_2C2A /* address in quad mode */
+       << SSI_SPI_CTRLR0_TRANS_TYPE_LSB);
+
+  // start with the settings of the boot stage 2
+  g_flashSsiBaudr = ssi_hw->baudr;
+  g_flashSsiRxSampleDelay = ssi_hw->rx_sample_dly;
+
+  printf("flash profile %s, %d bytes, mode bits %02x, %d wait cycles\n",
+         _profile->name, _flashSizeBytes, _profile->modeBits,
+         _profile->waitCycles);
+}
+
+const struct FlashSsiProfile *FlashSsi_GetProfile() { return _profile; }
+
+uint32_t FlashSsi_GetSizeBytes() { return _flashSizeBytes; }
+
+/*
+ * The word which needs to be written into the SSI data register to read from
+ * the flash while the SSI is not in XIP mode.
+ */
+uint32_t FlashSsi_DirectReadCommand(uint32_t flashOffset) {
+  return (flashOffset << 8) | _profile->modeBits;
+}
+
+static bool __no_inline_not_in_flash_func(directReadMatches)(
+    uint32_t baudr, uint32_t rxSampleDelay, uint32_t modeBits) {
+  const uint32_t xipBaudr = ssi_hw->baudr;
+  const uint32_t xipRxSampleDelay = ssi_hw->rx_sample_dly;
+  const uint32_t xipCtrlr0 = ssi_hw->ctrlr0;
+  const uint32_t xipSpiCtrlr0 = ssi_hw->spi_ctrlr0;
+  bool matches = true;
+
+  // same setup as setSsi8bit() with the settings to test
+  ssi_hw->ssienr = 0;
+  ssi_hw->baudr = baudr;
+  ssi_hw->rx_sample_dly = rxSampleDelay;
+  ssi_hw->ctrlr0 =
+      (SSI_CTRLR0_SPI_FRF_VALUE_QUAD /* Quad I/O mode */
+       << SSI_CTRLR0_SPI_FRF_LSB) |
+      (7 << SSI_CTRLR0_DFS_32_LSB) |     /* 8 data bits */
+      (SSI_CTRLR0_TMOD_VALUE_EEPROM_READ /* Send INST/ADDR, Receive Data */
+       << SSI_CTRLR0_TMOD_LSB);
+  ssi_hw->spi_ctrlr0 = g_flashSsiSpiCtrlr0;
+  ssi_hw->ssienr = 1;
+
+  for (uint32_t repeat = 0; repeat < CALIBRATION_REPEATS; repeat++) {
+    for (uint32_t i = 0; i < CALIBRATION_SIZE; i++) {
+      ssi_hw->dr0 = ((CALIBRATION_OFFSET + i) << 8) | modeBits;
+      while (!(ssi_hw->sr & SSI_SR_RFNE_BITS)) {
+        tight_loop_contents();
+      }
+      if ((uint8_t)ssi_hw->dr0 != _buffer[i]) {
+        matches = false;
+      }
+    }
+  }
+
+  ssi_hw->ssienr = 0;
+  ssi_hw->baudr = xipBaudr;
+  ssi_hw->rx_sample_dly = xipRxSampleDelay;
+  ssi_hw->ctrlr0 = xipCtrlr0;
+  ssi_hw->spi_ctrlr0 = xipSpiCtrlr0;
+  ssi_hw->ssienr = 1;
+
+  /*
+   * A too fast clock can make the flash miss the mode bits and leave the
+   * continuous read mode XIP relies on. flash_do_cmd() leaves XIP and sets it
+   * up again through the boot stage 2, which restores that mode.
+   */
+  if (!matches) {
+    const uint8_t tx[4] = {FLASH_CMD_READ_JEDEC_ID};
+    uint8_t rx[4];
+    flash_do_cmd(tx, rx, sizeof(tx));
+  }
+
+  return matches;
+}
+
+/*
+ * Tests all RX sample delays with the given clock divider. The delay in the
+ * middle of the longest working window is returned.
+ */
+static bool findRxSampleDelay(uint32_t divider, uint32_t *rxSampleDelay) {
+  const uint32_t modeBits = _profile->modeBits;
+  uint32_t windowStart = 0, windowLength = 0;
+  uint32_t bestStart = 0, bestLength = 0;
+
+  for (uint32_t delay = 0; delay <= CALIBRATION_MAX_RX_SAMPLE_DELAY; delay++) {
+    const uint32_t interrupts = save_and_disable_interrupts();
+    const bool matches = directReadMatches(divider, delay, modeBits);
+    restore_interrupts(interrupts);
+
+    if (matches) {
+      if (windowLength == 0) {
+        windowStart = delay;
+      }
+      windowLength++;
+      if (windowLength > bestLength) {
+        bestStart = windowStart;
+        bestLength = windowLength;
+      }
+    } else {
+      windowLength = 0;
+    }
+  }
+
+  printf("flash timing divider %d: %d working RX sample delays\n", divider,
+         bestLength);
+
+  if (bestLength == 0) {
+    return false;
+  }
+
+  *rxSampleDelay = bestStart + (bestLength / 2);
+  return true;
+}
+
+/*
+ * Starting at the clock divider of the boot stage 2, faster clocks are tested
+ * until the first one fails. The divider one step slower than the fastest
+ * working one is used to keep a margin. Only if the boot divider itself does
+ * not work, slower clocks are tested instead.
+ */
+static bool calibrateTiming(uint32_t *baudr, uint32_t *rxSampleDelay) {
+  const uint32_t bootBaudr = ssi_hw->baudr;
+  uint32_t delay;
+
+  memcpy(_buffer, (const void *)(XIP_BASE + CALIBRATION_OFFSET),
+         CALIBRATION_SIZE);
+
+  if (!findRxSampleDelay(bootBaudr, &delay)) {
+    for (uint32_t divider = bootBaudr + 2; divider <= CALIBRATION_MAX_BAUDR;
+         divider += 2) {
+      if (findRxSampleDelay(divider, &delay)) {
+        *baudr = divider;
+        *rxSampleDelay = delay;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  uint32_t fastestBaudr = bootBaudr, fastestDelay = delay;
+  *baudr = bootBaudr;
+  *rxSampleDelay = delay;
+
+  while (fastestBaudr >= (CALIBRATION_MIN_BAUDR + 2)) {
+    if (!findRxSampleDelay(fastestBaudr - 2, &delay)) {
+      break;
+    }
+    *baudr = fastestBaudr;
+    *rxSampleDelay = fastestDelay;
+    fastestBaudr -= 2;
+    fastestDelay = delay;
+  }
+
+  return true;
+}
+
+static uint32_t timingFileCrc(const struct FlashTimingFile *timing) {
+  return lfs_crc(0xFFFFFFFF, timing, offsetof(struct FlashTimingFile, crc));
+}
+
+void FlashSsi_LoadOrCalibrateTiming(lfs_t *lfs) {
+  lfs_file_t file;
+  struct lfs_file_config fileconfig = {.buffer = _buffer};
+  struct FlashTimingFile timing = {};
+  const uint32_t sysClkKhz = clock_get_hz(clk_sys) / 1000U;
+  const uint32_t bootBaudr = ssi_hw->baudr;
+
+  int lfs_err =
+      lfs_file_opencfg(lfs, &file, TIMING_FILE, LFS_O_RDONLY, &fileconfig);
+  if (lfs_err == LFS_ERR_OK) {
+    lfs_err = lfs_file_read(lfs, &file, &timing, sizeof(timing));
+    lfs_file_close(lfs, &file);
+
+    if ((lfs_err == (int)sizeof(timing)) && (timing.magic == TIMING_FILE_MAGIC) &&
+        (timing.sysClkKhz == sysClkKhz) && (timing.bootBaudr == bootBaudr) &&
+        (timing.crc == timingFileCrc(&timing))) {
+      g_flashSsiBaudr = timing.baudr;
+      g_flashSsiRxSampleDelay = timing.rxSampleDelay;
+      printf("flash timing from file: divider %d, RX sample delay %d\n",
+             g_flashSsiBaudr, g_flashSsiRxSampleDelay);
+      return;
+    }
+  }
+
+  uint32_t baudr, rxSampleDelay;
+  if (!calibrateTiming(&baudr, &rxSampleDelay)) {
+    printf("flash timing calibration failed, keeping boot settings\n");
+    return;
+  }
+
+  g_flashSsiBaudr = baudr;
+  g_flashSsiRxSampleDelay = rxSampleDelay;
+  printf("flash timing calibrated: divider %d, RX sample delay %d\n",
+         g_flashSsiBaudr, g_flashSsiRxSampleDelay);
+
+  timing = (struct FlashTimingFile){
+      .magic = TIMING_FILE_MAGIC,
+      .sysClkKhz = sysClkKhz,
+      .bootBaudr = bootBaudr,
+      .baudr = baudr,
+      .rxSampleDelay = rxSampleDelay,
+  };
+  timing.crc = timingFileCrc(&timing);
+
+  lfs_err = lfs_file_opencfg(lfs, &file, TIMING_FILE,
+                             LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC,
+                             &fileconfig);
+  if (lfs_err != LFS_ERR_OK) {
+    printf("Error opening file %d\n", lfs_err);
+    return;
+  }
+
+  lfs_err = lfs_file_write(lfs, &file, &timing, sizeof(timing));
+  if (lfs_err != (int)sizeof(timing)) {
+    printf("Error writing flash timing %d\n", lfs_err);
+  }
+
+  lfs_file_close(lfs, &file);
+}
@@ -0,0 +1,64 @@
+/* RP2040 GameBoy cartridge
+ * Copyright (C) 2024 Sebastian Quilitz
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef B7C1E5A2_4D3F_4E8B_9A61_5F2D8C0E7B94
+#define B7C1E5A2_4D3F_4E8B_9A61_5F2D8C0E7B94
+
+#include <lfs.h>
+#include <stdint.h>
+
+enum FlashQuadEnable {
+  FLASH_QE_NONE,      // quad mode is always enabled
+  FLASH_QE_SR2_BIT1,  // QE is bit 1 of status register 2, written with 01h
+  FLASH_QE_SR1_BIT6,  // QE is bit 6 of status register 1
+};
+
+/*
+ * Describes how the flash is read in continuous read mode (quad I/O fast read
+ * without sending the instruction again). Each access only sends the address,
+ * the mode bits which keep the flash in continuous read mode and the dummy
+ * cycles.
+ */
+struct FlashSsiProfile {
+  const char *name;
+  uint8_t manufacturerId; // first byte of the JEDEC ID
+  uint8_t modeBits;   // sent after the address to stay in continuous read mode
+  uint8_t waitCycles; // dummy cycles between the mode bits and the data
+  enum FlashQuadEnable quadEnable;
+};
+
+/*
+ * SPI_CTRLR0 value for the selected profile. It is used by setSsi8bit() and
+ * setSsi32bit() which run while the flash is not accessible.
+ */
+extern uint32_t g_flashSsiSpiCtrlr0;
+
+/*
+ * Clock divider and RX sample delay of the SSI, found by the timing
+ * calibration. Also applied by setSsi8bit() and setSsi32bit().
+ */
+extern uint32_t g_flashSsiBaudr;
+extern uint32_t g_flashSsiRxSampleDelay;
+
+void FlashSsi_Init();
+void FlashSsi_LoadOrCalibrateTiming(lfs_t *lfs);
+const struct FlashSsiProfile *FlashSsi_GetProfile();
+uint32_t FlashSsi_GetSizeBytes();
+uint32_t FlashSsi_DirectReadCommand(uint32_t flashOffset);
+
+#endif /* B7C1E5A2_4D3F_4E8B_9A61_5F2D8C0E7B94 */
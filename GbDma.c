@@ -20,10 +20,14 @@
 #include <hardware/structs/ssi.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 
+#include "FlashSsi.h"
 #include "GlobalDefines.h"
 #include "hardware/address_mapped.h"
 
+#include "gameboy_bus.pio.h"
+
 #define DMA_CHANNEL_CMD_EXECUTOR 0
 #define DMA_CHANNEL_CMD_LOADER 1
 #define DMA_CHANNEL_MEMORY_ACCESSOR 2
@@ -37,6 +41,16 @@ int _dmaChannelRomHigherDirectSsiBaseAddrLoader = -1;
 int _dmaChannelRomHigherDirectSsiFlashRequester = -1;
 int _dmaChannelRomHigherDirectSsiPioDataLoader = -1;
 
+/*
+ * Register values to switch the higher ROM DMA chain between reading from the
+ * flash through the SSI and reading banks cached in SRAM.
+ */
+static uint32_t _romHigherPioDataLoaderCtrlFlash;
+static uint32_t _romHigherPioDataLoaderCtrlSram;
+static uint32_t _romHigherShiftCtrlFlash;
+static uint32_t _romHigherShiftCtrlSram;
+static uint _romHighWaitPc;
+
 /*
  * as the DMA needs to transfer the address of this register a variable(pointer)
  * is needed that holds the address of the register
@@ -118,10 +132,171 @@ static struct DmaCommand RTC_WRITE[] = {
 
 /* clang-format on */
 
+/*
+ * Cost model of the chains serving GameBoy reads. It counts the DMA transfers
+ * between the DREQ of the PIO state machine and the byte arriving in
+ * txf[SMC_GB_WRITE_DATA]. Transfers after that only add bus load.
+ *
+ * Save RAM and RTC reads use the command chains above. Every DmaCommand is
+ * loaded by the CMD_LOADER (two words) and executed by the CMD_EXECUTOR (one
+ * word). Together with the REQUESTOR at the start and the MEMORY_ACCESSOR at
+ * the end this gives the number of AHB transfers. The NULL entry which ends
+ * the chain is loaded after the MEMORY_ACCESSOR got triggered.
+ */
+#define DMA_CHAIN_COMMANDS(TABLE) ((sizeof(TABLE) / sizeof(TABLE[0])) - 1)
+#define DMA_CHAIN_AHB_TRANSFERS(TABLE)                                         \
+  (1 + 2 * (DMA_CHAIN_COMMANDS(TABLE) + 1) + DMA_CHAIN_COMMANDS(TABLE) + 1)
+#define DMA_CHAIN_CRITICAL_TRANSFERS(TABLE)                                    \
+  (1 + 3 * DMA_CHAIN_COMMANDS(TABLE) + 1)
+
+/*
+ * The lower ROM is served by setup_read_dma_method2(): the address from the
+ * FIFO, the base address or-ed into the read address and the byte itself.
+ */
+#define DMA_ROM_LOWER_TRANSFERS 3
+
+/*
+ * The higher ROM is served by the chain of GbDma_SetupHigherDmaDirectSsi():
+ * PioAddrLoader, BaseAddrLoader, FlashRequester and PioDataLoader. For banks
+ * in flash the PioDataLoader additionally waits for the SSI to clock out the
+ * address and mode bits (8 clocks in quad mode), the wait cycles and the data
+ * (2 clocks).
+ */
+#define DMA_ROM_HIGHER_TRANSFERS 4
+#define DMA_SSI_DIRECT_READ_CLOCKS(waitCycles) (8 + (waitCycles) + 2)
+
+/*
+ * On a double speed read the data needs to be in txf[SMC_GB_WRITE_DATA] early
+ * enough for the write_to_data SM (4 instructions until it drives the bus) to
+ * meet the data setup time before the end of the bus cycle. The DREQ fires
+ * when the address is sampled.
+ */
+#define GB_DMA_DATA_SETUP_NS 50
+#define GB_DMA_WRITE_TO_DATA_CYCLES 4
+#define GB_DMA_READ_DEADLINE_CYCLES_DOUBLE_SPEED                               \
+  (((GB_BUS_CYCLE_NS_DOUBLE_SPEED - GB_DMA_DATA_SETUP_NS) * SYSCLK_MHZ) /      \
+       1000 -                                                                  \
+   ADDR_SAMPLE_CYCLES_DOUBLE_SPEED - GB_DMA_WRITE_TO_DATA_CYCLES)
+
+#define PRINT_DMA_CHAIN_COST(TABLE)                                            \
+  printf("DMA %s: %d cmds, %d transfers, %d until data\n", #TABLE,             \
+         (int)DMA_CHAIN_COMMANDS(TABLE), (int)DMA_CHAIN_AHB_TRANSFERS(TABLE),  \
+         (int)DMA_CHAIN_CRITICAL_TRANSFERS(TABLE))
+
 static volatile void *_lowerRomReadCommands = &LOWER_ROM_READ[0];
 static volatile void *_ramReadCommands = &RAM_READ[0];
 static volatile void *_ramWriteCommands = &RAM_WRITE[0];
 
+/*
+ * The chain is parked between two reads: the PioAddrLoader waits for the next
+ * address, the rest of the chain is done, no address is waiting in the FIFO
+ * and the state machine waits for the next read.
+ */
+static __force_inline bool romHigherChainBusy() {
+  return dma_channel_is_busy(_dmaChannelRomHigherDirectSsiBaseAddrLoader) ||
+         dma_channel_is_busy(_dmaChannelRomHigherDirectSsiFlashRequester) ||
+         dma_channel_is_busy(_dmaChannelRomHigherDirectSsiPioDataLoader);
+}
+
+static __force_inline bool romHigherChainParked() {
+  return dma_channel_is_busy(_dmaChannelRomHigherDirectSsiPioAddrLoader) &&
+         !romHigherChainBusy() &&
+         pio_sm_is_rx_fifo_empty(pio0, SMC_GB_ROM_HIGH) &&
+         (pio_sm_get_pc(pio0, SMC_GB_ROM_HIGH) == _romHighWaitPc);
+}
+
+/*
+ * Waits until the chain is parked and pauses the PioAddrLoader, so a read
+ * arriving during the switch waits in the FIFO instead of running through a
+ * half switched chain. If a read slips in before the pause takes effect, it
+ * is finished with the old setup first. A paused channel ignores the chain
+ * trigger of the PioDataLoader, so it is triggered again if that happened.
+ */
+static void __no_inline_not_in_flash_func(pauseRomHigherChain)() {
+  io_rw_32 *addrLoaderCtrl =
+      &dma_hw->ch[_dmaChannelRomHigherDirectSsiPioAddrLoader].al1_ctrl;
+
+  while (true) {
+    while (!romHigherChainParked()) {
+      tight_loop_contents();
+    }
+
+    hw_clear_bits(addrLoaderCtrl, DMA_CH0_CTRL_TRIG_EN_BITS);
+    (void)*addrLoaderCtrl; // the pause is in effect once this read returns
+
+    if (romHigherChainParked()) {
+      return;
+    }
+
+    while (romHigherChainBusy()) {
+      tight_loop_contents();
+    }
+    hw_set_bits(addrLoaderCtrl, DMA_CH0_CTRL_TRIG_EN_BITS);
+    if (!dma_channel_is_busy(_dmaChannelRomHigherDirectSsiPioAddrLoader)) {
+      dma_hw->multi_channel_trigger =
+          1U << _dmaChannelRomHigherDirectSsiPioAddrLoader;
+    }
+  }
+}
+
+/*
+ * The push threshold changes with the mode, so the ISR and its shift count
+ * must be cleared. This is done with the state machine stopped and restarted
+ * at its wait, so it can not happen between the two IN instructions of a
+ * read. An address pushed after the chain got paused has the format of the
+ * old mode and is dropped. This costs at most that one byte, while passing it
+ * on could make the chain read from an invalid address and halt.
+ */
+static void __no_inline_not_in_flash_func(switchRomHigherChain)(
+    uintptr_t flashRequesterWriteAddr, uint32_t pioDataLoaderCtrl,
+    uint32_t shiftCtrl) {
+  // before the game starts there is nothing in flight to wait for
+  const bool running =
+      (pio0->ctrl & (1U << (PIO_CTRL_SM_ENABLE_LSB + SMC_GB_ROM_HIGH))) != 0U;
+
+  if (running) {
+    pauseRomHigherChain();
+  }
+
+  dma_hw->ch[_dmaChannelRomHigherDirectSsiFlashRequester].write_addr =
+      flashRequesterWriteAddr;
+  dma_hw->ch[_dmaChannelRomHigherDirectSsiPioDataLoader].read_addr =
+      (uintptr_t) & (ssi_hw->dr0);
+  dma_hw->ch[_dmaChannelRomHigherDirectSsiPioDataLoader].al1_ctrl =
+      pioDataLoaderCtrl;
+
+  pio_sm_set_enabled(pio0, SMC_GB_ROM_HIGH, false);
+  pio0->sm[SMC_GB_ROM_HIGH].shiftctrl = shiftCtrl;
+  pio_sm_restart(pio0, SMC_GB_ROM_HIGH);
+  pio_sm_exec(pio0, SMC_GB_ROM_HIGH, pio_encode_jmp(_romHighWaitPc));
+  while (!pio_sm_is_rx_fifo_empty(pio0, SMC_GB_ROM_HIGH)) {
+    (void)pio0->rxf[SMC_GB_ROM_HIGH];
+  }
+  pio_sm_set_enabled(pio0, SMC_GB_ROM_HIGH, running);
+
+  hw_set_bits(&dma_hw->ch[_dmaChannelRomHigherDirectSsiPioAddrLoader].al1_ctrl,
+              DMA_CH0_CTRL_TRIG_EN_BITS);
+}
+
+/*
+ * Called from the MBC while a game runs. A game can only read the higher ROM
+ * area again one bus cycle after the bank write which got it here, so the
+ * chain is normally parked already and the switch only takes the time of the
+ * register writes.
+ */
+void __no_inline_not_in_flash_func(GbDma_RomHigherFromSram)() {
+  switchRomHigherChain(
+      (uintptr_t) & (dma_hw->ch[_dmaChannelRomHigherDirectSsiPioDataLoader]
+                         .read_addr),
+      _romHigherPioDataLoaderCtrlSram, _romHigherShiftCtrlSram);
+}
+
+void __no_inline_not_in_flash_func(GbDma_RomHigherFromFlash)() {
+  switchRomHigherChain((uintptr_t) & (ssi_hw->dr0),
+                       _romHigherPioDataLoaderCtrlFlash,
+                       _romHigherShiftCtrlFlash);
+}
+
 static void setup_read_dma_method2(PIO pio, unsigned sm, PIO pio_write_data,
                                    unsigned sm_write_data,
                                    const volatile void *read_base_addr);
@@ -231,6 +406,34 @@ void GbDma_Setup() {
   );
 }
 
+/*
+ * Needs to be called after the flash timing is known. Only the SSI time is
+ * derived from the hardware settings, so a warning is printed if it alone
+ * already misses the double speed read deadline.
+ */
+void GbDma_PrintChainCosts() {
+  const uint32_t ssiCycles =
+      DMA_SSI_DIRECT_READ_CLOCKS(FlashSsi_GetProfile()->waitCycles) *
+      g_flashSsiBaudr;
+
+  printf("DMA read deadline double speed %d cycles\n",
+         GB_DMA_READ_DEADLINE_CYCLES_DOUBLE_SPEED);
+  printf("DMA lower ROM: %d transfers until data\n", DMA_ROM_LOWER_TRANSFERS);
+  printf("DMA higher ROM from SRAM: %d transfers until data\n",
+         DMA_ROM_HIGHER_TRANSFERS);
+  printf("DMA higher ROM from flash: %d transfers and %d SSI cycles until "
+         "data\n",
+         DMA_ROM_HIGHER_TRANSFERS, ssiCycles);
+  PRINT_DMA_CHAIN_COST(RAM_READ);
+  PRINT_DMA_CHAIN_COST(RAM_WRITE);
+  PRINT_DMA_CHAIN_COST(RTC_READ);
+  PRINT_DMA_CHAIN_COST(RTC_WRITE);
+
+  if (ssiCycles > GB_DMA_READ_DEADLINE_CYCLES_DOUBLE_SPEED) {
+    printf("Warning: flash reads miss the double speed read deadline\n");
+  }
+}
+
 void GbDma_SetupHigherDmaDirectSsi() {
   _dmaChannelRomHigherDirectSsiPioAddrLoader = dma_claim_unused_channel(true);
   _dmaChannelRomHigherDirectSsiBaseAddrLoader = dma_claim_unused_channel(true);
@@ -287,6 +490,23 @@ void GbDma_SetupHigherDmaDirectSsi() {
                         false // will be triggered by FlashRequester
   );
 
+  /*
+   * For banks cached in SRAM the FlashRequester writes the summed up address
+   * directly into the read address of the PioDataLoader, which then does not
+   * need to wait for the SSI. The ROM high state machine pushes the plain
+   * address without the 8 bit shift needed for the SSI command in that case.
+   */
+  _romHigherPioDataLoaderCtrlFlash = channel_config_get_ctrl_value(&c);
+  channel_config_set_dreq(&c, DREQ_FORCE);
+  _romHigherPioDataLoaderCtrlSram = channel_config_get_ctrl_value(&c);
+
+  // the state machine is initialized but not started, so it is at its wait
+  _romHighWaitPc = pio_sm_get_pc(pio0, SMC_GB_ROM_HIGH);
+  _romHigherShiftCtrlFlash = pio0->sm[SMC_GB_ROM_HIGH].shiftctrl;
+  _romHigherShiftCtrlSram =
+      (_romHigherShiftCtrlFlash & ~PIO_SM0_SHIFTCTRL_PUSH_THRESH_BITS) |
+      (14 << PIO_SM0_SHIFTCTRL_PUSH_THRESH_LSB);
+
   // Do not trigger the first stage dma yet. This will be done only after SSI is
   // in the correct mode
 }
@@ -347,6 +567,54 @@ static void setup_read_dma_method2(PIO pio, unsigned sm, PIO pio_write_data,
   dma_channel_set_config(dma3, &cfg, false);
 }
 
+/*
+ * CRC-32 (as used by zlib) of len bytes at data, continuing from crc. The
+ * calculation is done by the DMA sniffer while the MEMORY_ACCESSOR channel
+ * reads the data into _devNull. This is only allowed while no GameBoy is
+ * served, as the channel and the sniffer are borrowed from the bus DMAs and
+ * restored afterwards.
+ */
+static uint32_t bitReverse(uint32_t value) {
+  uint32_t reversed = 0;
+  for (size_t i = 0; i < 32; i++) {
+    reversed = (reversed << 1) | (value & 1U);
+    value >>= 1;
+  }
+  return reversed;
+}
+
+uint32_t GbDma_Crc32(uint32_t crc, const void *data, size_t len) {
+  const uint32_t sniffCtrl = dma_hw->sniff_ctrl;
+  const uint32_t sniffData = dma_hw->sniff_data;
+
+  dma_channel_config c =
+      dma_channel_get_default_config(DMA_CHANNEL_MEMORY_ACCESSOR);
+  channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+  channel_config_set_read_increment(&c, true);
+  channel_config_set_write_increment(&c, false);
+  channel_config_set_sniff_enable(&c, true);
+
+  // the sniffer works MSB first, so the reflected CRC needs the seed and the
+  // result bit reversed
+  dma_hw->sniff_data = bitReverse(~crc);
+  dma_sniffer_enable(DMA_CHANNEL_MEMORY_ACCESSOR,
+                     DMA_SNIFF_CTRL_CALC_VALUE_CRC32R, true);
+  hw_set_bits(&dma_hw->sniff_ctrl,
+              DMA_SNIFF_CTRL_OUT_REV_BITS | DMA_SNIFF_CTRL_OUT_INV_BITS);
+
+  dma_channel_configure(DMA_CHANNEL_MEMORY_ACCESSOR, &c, &_devNull, data, len,
+                        true);
+  dma_channel_wait_for_finish_blocking(DMA_CHANNEL_MEMORY_ACCESSOR);
+
+  crc = dma_hw->sniff_data;
+
+  dma_hw->sniff_ctrl = sniffCtrl;
+  dma_hw->sniff_data = sniffData;
+  dma_channel_set_trans_count(DMA_CHANNEL_MEMORY_ACCESSOR, 1, false);
+
+  return crc;
+}
+
 void __no_inline_not_in_flash_func(GbDma_EnableSaveRam)() {
   _ramReadCommands = &RAM_READ[0];
   _ramWriteCommands = &RAM_WRITE[0];
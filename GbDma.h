@@ -18,15 +18,21 @@
 #ifndef D2C8524D_9F5F_4D9E_BD87_3A37DED846AC
 #define D2C8524D_9F5F_4D9E_BD87_3A37DED846AC
 
+#include <stddef.h>
 #include <stdint.h>
 
 void GbDma_Setup();
 void GbDma_SetupHigherDmaDirectSsi();
+void GbDma_PrintChainCosts();
 
 void GbDma_StartDmaDirect();
+void GbDma_RomHigherFromSram();
+void GbDma_RomHigherFromFlash();
 
 void GbDma_EnableSaveRam();
 void GbDma_DisableSaveRam();
 void GbDma_EnableRtc();
 
+uint32_t GbDma_Crc32(uint32_t crc, const void *data, size_t len);
+
 #endif /* D2C8524D_9F5F_4D9E_BD87_3A37DED846AC */
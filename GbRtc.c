@@ -16,7 +16,6 @@
    (((1970 + (Y)) % 100) || !((1970 + (Y)) % 400)))
 
 static volatile uint8_t _registerMasks[] = {0x3f, 0x3f, 0x1f, 0xff, 0xc1};
-static uint8_t _currentRegister = 0;
 
 static uint64_t _lastMilli = 0;
 static uint32_t _millies = 0;
@@ -25,12 +24,17 @@ static uint64_t _lastTimestampTick = 0;
 
 static inline void GbRtc_processTick();
 
-void __no_inline_not_in_flash_func(GbRtc_WriteRegister)(uint8_t val) {
+void __no_inline_not_in_flash_func(GbRtc_WriteRegister)(uint8_t reg,
+                                                        uint8_t val) {
+  if (reg >= sizeof(_registerMasks)) {
+    return;
+  }
+
   const uint8_t oldHalt = g_rtcReal.reg.status.halt;
 
-  g_rtcReal.asArray[_currentRegister] = val & _registerMasks[_currentRegister];
+  g_rtcReal.asArray[reg] = val & _registerMasks[reg];
 
-  if (_currentRegister == 0) {
+  if (reg == 0) {
     _lastMilli = time_us_64();
     _millies = 0;
   }
@@ -46,7 +50,6 @@ void __no_inline_not_in_flash_func(GbRtc_ActivateRegister)(uint8_t reg) {
   }
 
   _rtcLatchPtr = &g_rtcLatched.asArray[reg];
-  _currentRegister = reg;
 }
 
 void __no_inline_not_in_flash_func(GbRtc_PerformRtcTick)() {
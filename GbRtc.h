@@ -12,7 +12,7 @@ struct __attribute__((packed)) TimePoint {
   uint8_t Year; // offset from 1970;
 };
 
-void GbRtc_WriteRegister(uint8_t val);
+void GbRtc_WriteRegister(uint8_t reg, uint8_t val);
 void GbRtc_ActivateRegister(uint8_t reg);
 void GbRtc_PerformRtcTick();
 void GbRtc_advanceToNewTimestamp(uint64_t newTimestamp);
@@ -36,12 +36,37 @@
 #define SMC_GB_WRITE_DATA 2
 #define SMC_GB_A15LOW_A14IRQS 3
 
+/* duration of one bus cycle, the bus clock is 1.048576 MHz */
+#define GB_BUS_CYCLE_NS 954
+#define GB_BUS_CYCLE_NS_DOUBLE_SPEED 477
+
 #define GB_MBC2_RAM_SIZE 0x200U
 #define GB_RAM_BANK_SIZE 0x2000U
 #define GB_ROM_BANK_SIZE 0x4000U
 /* 16 banks = 128K of RAM enough for MBC3 (32K) and MBC5*/
 #define GB_MAX_RAM_BANKS 16
 
+/*
+ * Maximum number of switchable ROM banks copied into the save RAM which is not
+ * used by the game. At most 8 banks fit if a game has no save RAM.
+ */
+#ifndef GB_ROM_CACHE_BANKS
+#define GB_ROM_CACHE_BANKS 8
+#endif
+
+/*
+ * Save RAM written by the game is tracked in pages of this size, so only the
+ * changed parts of a save need to be written to flash.
+ */
+#define SAVE_RAM_PAGE_SIZE 256U
+#define SAVE_RAM_NUM_PAGES                                                     \
+  ((GB_MAX_RAM_BANKS * GB_RAM_BANK_SIZE) / SAVE_RAM_PAGE_SIZE)
+#define SAVE_RAM_PAGE_IS_DIRTY(pages, page)                                    \
+  ((pages)[(page) / 32] & (1U << ((page) % 32)))
+
+/* per game profile of the selected ROM banks, stored next to the save */
+#define BANK_PROFILE_FILE_SUFFIX ".banks"
+
 #define ROM_STORAGE_FLASH_START_ADDR 0x00020000
 #define MAX_BANKS 888
 #define MAX_BANKS_PER_ROM 0x200
@@ -81,11 +106,17 @@ extern bool g_hardwareSupportsDoubleSpeed;
 extern const uint8_t *g_loadedRomBanks[MAX_BANKS_PER_ROM];
 extern uint32_t g_loadedDirectAccessRomBanks[MAX_BANKS_PER_ROM];
 extern struct RomInfo g_loadedRomInfo;
+extern uint32_t g_saveRamDirtyPages[SAVE_RAM_NUM_PAGES / 32];
 
 void setSsi8bit();
 void setSsi32bit();
 void loadDoubleSpeedPio(uint16_t bank, uint16_t addr);
+void loadWritesOnlyPio();
 void storeSaveRamToFile(const struct RomInfo *shortRomInfo);
+int restoreBankProfileFromFile(const struct RomInfo *romInfo,
+                               uint32_t *selects, uint16_t numBanks);
+void storeBankProfileToFile(const struct RomInfo *romInfo, uint32_t *selects,
+                            uint16_t numBanks);
 void restoreSaveRamFromFile(const struct RomInfo *shortRomInfo);
 int restoreRtcFromFile(const struct RomInfo *romInfo);
 void storeRtcToFile(const struct RomInfo *romInfo);
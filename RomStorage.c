@@ -17,7 +17,10 @@
 
 #include "RomStorage.h"
 
+#include "FlashSsi.h"
 #include "GameBoyHeader.h"
+#include "GbDma.h"
+#include "SaveSlot.h"
 
 #include "lfs.h"
 #include <assert.h>
@@ -34,6 +37,7 @@
 
 #include "GlobalDefines.h"
 #include "lfs_pico_hal.h"
+#include "lfs_util.h"
 
 #define SetBit(A, k) (A[(k) / 32] |= (1 << ((k) % 32)))
 #define ClearBit(A, k) (A[(k) / 32] &= ~(1 << ((k) % 32)))
@@ -44,12 +48,17 @@
                      ROM_STORAGE_FLASH_START_ADDR + 0x13000000))
 
 #define RomBankToDirectSsi(BANK)                                               \
-  ((((BANK * GB_ROM_BANK_SIZE) + ROM_STORAGE_FLASH_START_ADDR) << 8) | 0xA0)
+  FlashSsi_DirectReadCommand((BANK * GB_ROM_BANK_SIZE) +                       \
+                             ROM_STORAGE_FLASH_START_ADDR)
 
 #define TRANSFER_CHUNK_SIZE 32
 #define CHUNKS_PER_BANK (GB_ROM_BANK_SIZE / TRANSFER_CHUNK_SIZE)
 
 #define ROMINFO_FILE_MAGIC 0xCAFEBABE
+#define ROMINFO_FILE_MAGIC_CRC 0xCAFEBABF // adds the CRC-32 of each bank
+#define ROM_CATALOG_MAGIC 0xCA7A1061
+
+#define ROM_CATALOG_FILE "/catalog"
 
 static lfs_t *_lfs = NULL;
 static uint8_t _lfsFileBuffer[LFS_CACHE_SIZE];
@@ -66,9 +75,16 @@ struct __attribute__((__packed__)) RomInfoFile {
   uint16_t numBanks;
   uint16_t speedSwitchBank;
   uint16_t banks[MAX_BANKS_PER_ROM];
+  uint32_t bankCrcs[MAX_BANKS_PER_ROM];
 } _romInfoFile;
 
-static uint8_t _bankBuffer[GB_ROM_BANK_SIZE];
+/*
+ * The ROM is written while it is received. The flash sectors of a bank are
+ * erased when the first chunk for them arrives and each page is programmed as
+ * soon as it is complete, so only one page needs to be buffered.
+ */
+static uint8_t _pageBuffer[FLASH_PAGE_SIZE];
+static uint32_t _receivedBankCrc = 0xFFFFFFFF;
 static uint16_t _lastTransferredBank = 0xFFFF;
 static uint16_t _lastTransferredChunk = 0xFFFF;
 static char _fileNameBuffer[25] = "/roms/";
@@ -76,10 +92,47 @@ static char _filenamebufferSaves[40] = "saves/";
 
 static size_t _ramBytesTransferred = 0;
 static size_t _ramBytesToTransfer = 0;
+static struct SaveSlotRecord _ramUploadRecord;
+
+/*
+ * Encoded saves are decoded while they are downloaded, the decoder keeps what
+ * is left of the last read from the file.
+ */
+static bool _ramDownloadRle = false;
+static struct SaveSlotRleDecoder _ramDownloadDecoder;
+static uint8_t _ramDownloadBuffer[64];
+static size_t _ramDownloadBufferPos = 0;
+static size_t _ramDownloadBufferLen = 0;
 
 static bool _romTransferActive = false;
 static bool _ramTransferActive = false;
 
+/*
+ * The catalog holds the info of all ROMs in the order of the /roms directory,
+ * so the info of a ROM can be read without walking the directory. It is
+ * rebuilt from /roms whenever a ROM is added or deleted or it fails
+ * validation.
+ */
+struct __attribute__((__packed__)) RomCatalogHeader {
+  uint32_t magic;
+  uint16_t numRoms;
+  uint16_t usedBanks;
+  uint32_t usedBanksFlags[28];
+  uint32_t crc; // over the header up to here and all entries
+};
+
+struct __attribute__((__packed__)) RomCatalogEntry {
+  char name[17];
+  uint16_t firstBank;
+  uint16_t numBanks;
+  uint16_t speedSwitchBank;
+  uint8_t mbc;
+  uint8_t numRamBanks;
+};
+
+static uint8_t _catalogFileBuffer[LFS_CACHE_SIZE];
+struct lfs_file_config _catalogFileconfig = {.buffer = _catalogFileBuffer};
+
 static int readRomInfoFile(lfs_file_t *file) {
   int lfs_err = 0;
   lfs_err = lfs_file_read(_lfs, file, &_romInfoFile,
@@ -89,7 +142,8 @@ static int readRomInfoFile(lfs_file_t *file) {
     return lfs_err;
   }
 
-  if (_romInfoFile.magic == ROMINFO_FILE_MAGIC) {
+  if ((_romInfoFile.magic == ROMINFO_FILE_MAGIC) ||
+      (_romInfoFile.magic == ROMINFO_FILE_MAGIC_CRC)) {
     lfs_err = lfs_file_read(_lfs, file, &_romInfoFile.speedSwitchBank,
                             sizeof(uint16_t));
   } else {
@@ -103,28 +157,70 @@ static int readRomInfoFile(lfs_file_t *file) {
     return lfs_err;
   }
 
+  if (_romInfoFile.magic == ROMINFO_FILE_MAGIC_CRC) {
+    lfs_err = lfs_file_read(_lfs, file, &_romInfoFile.bankCrcs,
+                            _romInfoFile.numBanks * sizeof(uint32_t));
+    if (lfs_err != _romInfoFile.numBanks * sizeof(uint32_t)) {
+      printf("Error reading bank CRCs %d\n", lfs_err);
+      return lfs_err;
+    }
+  }
+
   return 0;
 }
 
-int RomStorage_init(lfs_t *lfs) {
+static int readRomCatalog() {
   int err = 0;
-  lfs_dir_t dir = {};
   lfs_file_t file = {};
-  struct lfs_info lfsInfo = {};
+  struct RomCatalogHeader header = {};
+  struct RomCatalogEntry entry = {};
   int lfs_err = 0;
 
-  _lfs = lfs;
+  lfs_err = lfs_file_opencfg(_lfs, &file, ROM_CATALOG_FILE, LFS_O_RDONLY,
+                             &_catalogFileconfig);
+  if (lfs_err != LFS_ERR_OK) {
+    return -1;
+  }
 
-  memset(_usedBanksFlags, 0, sizeof(_usedBanksFlags));
-  g_numRoms = 0;
-  _usedBanks = 0;
+  lfs_err = lfs_file_read(_lfs, &file, &header, sizeof(header));
+  PRINTASSURE(lfs_err == sizeof(header), "Error reading catalog %d\n",
+              lfs_err);
+  PRINTASSURE(header.magic == ROM_CATALOG_MAGIC, "Invalid catalog magic\n");
+  PRINTASSURE(header.numRoms <= MAX_ALLOWED_ROMS,
+              "Invalid number of ROMs in catalog\n");
 
-  lfs_err = lfs_mkdir(_lfs, "/roms");
-  PRINTASSURE((lfs_err == LFS_ERR_OK) || (lfs_err == LFS_ERR_EXIST),
-              "Error creating roms directory %d\n", lfs_err);
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < header.numRoms; i++) {
+    lfs_err = lfs_file_read(_lfs, &file, &entry, sizeof(entry));
+    PRINTASSURE(lfs_err == sizeof(entry), "Error reading catalog %d\n",
+                lfs_err);
+    crc = lfs_crc(crc, &entry, sizeof(entry));
+  }
+  crc = lfs_crc(crc, &header, offsetof(struct RomCatalogHeader, crc));
+  PRINTASSURE(crc == header.crc, "Catalog CRC mismatch\n");
+
+  memcpy(_usedBanksFlags, header.usedBanksFlags, sizeof(_usedBanksFlags));
+  _usedBanks = header.usedBanks;
+  g_numRoms = header.numRoms;
+
+error:
+  lfs_file_close(_lfs, &file);
+  return err;
+}
+
+static int addRomsToCatalog(lfs_file_t *catalogFile, uint32_t *crc) {
+  int err = 0;
+  lfs_dir_t dir = {};
+  lfs_file_t file = {};
+  struct lfs_info lfsInfo = {};
+  struct RomCatalogEntry entry = {};
+  int lfs_err = 0;
 
   lfs_err = lfs_dir_open(_lfs, &dir, "/roms");
-  ASSURE(lfs_err == LFS_ERR_OK);
+  if (lfs_err != LFS_ERR_OK) {
+    printf("Error opening roms directory %d\n", lfs_err);
+    return -1;
+  }
 
   lfs_err = lfs_dir_read(_lfs, &dir, &lfsInfo);
   while (lfs_err > 0) {
@@ -145,6 +241,21 @@ int RomStorage_init(lfs_t *lfs) {
         _usedBanks++;
       }
 
+      const uint8_t *firstBank = RomBankToPointer(_romInfoFile.banks[0]);
+
+      memset(&entry, 0, sizeof(entry));
+      memcpy(entry.name, lfsInfo.name, 16);
+      entry.firstBank = _romInfoFile.banks[0];
+      entry.numBanks = _romInfoFile.numBanks;
+      entry.speedSwitchBank = _romInfoFile.speedSwitchBank;
+      entry.mbc = GameBoyHeader_readMbc(firstBank);
+      entry.numRamBanks = GameBoyHeader_readRamBankCount(firstBank);
+
+      lfs_err = lfs_file_write(_lfs, catalogFile, &entry, sizeof(entry));
+      PRINTASSURE(lfs_err == sizeof(entry), "Error writing catalog %d\n",
+                  lfs_err);
+      *crc = lfs_crc(*crc, &entry, sizeof(entry));
+
       printf("Added %d used banks\n", _romInfoFile.numBanks);
       g_numRoms++;
     }
@@ -152,60 +263,123 @@ int RomStorage_init(lfs_t *lfs) {
     lfs_err = lfs_dir_read(_lfs, &dir, &lfsInfo);
   }
 
-  printf("%d banks of 888 in use\n", _usedBanks);
-
 error:
   lfs_dir_close(_lfs, &dir);
   return err;
 }
 
-int RomStorage_loadRomInfo(uint32_t rom, struct RomInfo *outRomInfo) {
+static int rebuildRomCatalog() {
   int err = 0;
-  lfs_dir_t dir = {};
-  lfs_file_t file = {};
-  struct lfs_info lfsInfo = {};
+  lfs_file_t catalogFile = {};
+  struct RomCatalogHeader header = {};
+  uint32_t crc = 0xFFFFFFFF;
   int lfs_err = 0;
-  bool romFound = false;
 
-  ASSURE(rom < g_numRoms);
+  memset(_usedBanksFlags, 0, sizeof(_usedBanksFlags));
+  g_numRoms = 0;
+  _usedBanks = 0;
 
-  lfs_err = lfs_dir_open(_lfs, &dir, "/roms");
-  ASSURE(lfs_err == LFS_ERR_OK);
+  printf("Rebuilding ROM catalog\n");
 
-  lfs_err = lfs_dir_read(_lfs, &dir, &lfsInfo);
-  while ((lfs_err > 0) && !romFound) {
-    if (lfsInfo.type == LFS_TYPE_REG && rom-- == 0) {
-      char filename[32];
-      snprintf(filename, sizeof(filename), "/roms/%s", lfsInfo.name);
-      printf("RomStorage_loadRomInfo %s\n", filename);
-      lfs_err =
-          lfs_file_opencfg(_lfs, &file, filename, LFS_O_RDONLY, &_fileconfig);
-      PRINTASSURE(lfs_err == LFS_ERR_OK, "Error opening file %d\n", lfs_err);
+  lfs_err = lfs_file_opencfg(_lfs, &catalogFile, ROM_CATALOG_FILE,
+                             LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC,
+                             &_catalogFileconfig);
+  if (lfs_err != LFS_ERR_OK) {
+    printf("Error opening catalog %d\n", lfs_err);
+    return -1;
+  }
 
-      lfs_err = readRomInfoFile(&file);
+  // the header is written again when all entries are known
+  lfs_err = lfs_file_write(_lfs, &catalogFile, &header, sizeof(header));
+  PRINTASSURE(lfs_err == sizeof(header), "Error writing catalog %d\n",
+              lfs_err);
 
-      lfs_file_close(_lfs, &file);
-      ASSURE(lfs_err == LFS_ERR_OK);
+  ASSURE(addRomsToCatalog(&catalogFile, &crc) == 0);
 
-      memcpy(outRomInfo->name, lfsInfo.name, 16);
-      outRomInfo->name[16] = 0;
-      outRomInfo->numRomBanks = _romInfoFile.numBanks;
-      outRomInfo->firstBank = RomBankToPointer(_romInfoFile.banks[0]);
-      outRomInfo->numRamBanks =
-          GameBoyHeader_readRamBankCount(outRomInfo->firstBank);
-      outRomInfo->mbc = GameBoyHeader_readMbc(outRomInfo->firstBank);
-      outRomInfo->speedSwitchBank = _romInfoFile.speedSwitchBank;
+  header.magic = ROM_CATALOG_MAGIC;
+  header.numRoms = g_numRoms;
+  header.usedBanks = _usedBanks;
+  memcpy(header.usedBanksFlags, _usedBanksFlags, sizeof(_usedBanksFlags));
+  header.crc = lfs_crc(crc, &header, offsetof(struct RomCatalogHeader, crc));
 
-      romFound = true;
-    }
+  lfs_err = lfs_file_seek(_lfs, &catalogFile, 0, LFS_SEEK_SET);
+  PRINTASSURE(lfs_err >= 0, "Error seeking catalog %d\n", lfs_err);
 
-    lfs_err = lfs_dir_read(_lfs, &dir, &lfsInfo);
+  lfs_err = lfs_file_write(_lfs, &catalogFile, &header, sizeof(header));
+  PRINTASSURE(lfs_err == sizeof(header), "Error writing catalog %d\n",
+              lfs_err);
+
+error:
+  // on errors the header stays zeroed, so the catalog fails validation on
+  // the next boot and is rebuilt
+  lfs_file_close(_lfs, &catalogFile);
+  return err;
+}
+
+/*
+ * The catalog is only checked against its own CRC. It is removed before /roms
+ * is changed, so a power loss before it is rebuilt leaves no catalog instead
+ * of an outdated one, and it is rebuilt on the next boot.
+ */
+static void invalidateRomCatalog() {
+  const int lfs_err = lfs_remove(_lfs, ROM_CATALOG_FILE);
+  if ((lfs_err < 0) && (lfs_err != LFS_ERR_NOENT)) {
+    printf("Error removing catalog %d\n", lfs_err);
+  }
+}
+
+int RomStorage_init(lfs_t *lfs) {
+  int err = 0;
+  int lfs_err = 0;
+
+  _lfs = lfs;
+
+  lfs_err = lfs_mkdir(_lfs, "/roms");
+  PRINTASSURE((lfs_err == LFS_ERR_OK) || (lfs_err == LFS_ERR_EXIST),
+              "Error creating roms directory %d\n", lfs_err);
+
+  if (readRomCatalog() != 0) {
+    ASSURE(rebuildRomCatalog() == 0);
   }
 
-  ASSURE(romFound);
+  printf("%d banks of 888 in use\n", _usedBanks);
+
+error:
+  return err;
+}
+
+int RomStorage_loadRomInfo(uint32_t rom, struct RomInfo *outRomInfo) {
+  int err = 0;
+  lfs_file_t file = {};
+  struct RomCatalogEntry entry = {};
+  int lfs_err = 0;
+
+  ASSURE(rom < g_numRoms);
+
+  lfs_err = lfs_file_opencfg(_lfs, &file, ROM_CATALOG_FILE, LFS_O_RDONLY,
+                             &_catalogFileconfig);
+  PRINTASSURE(lfs_err == LFS_ERR_OK, "Error opening catalog %d\n", lfs_err);
+
+  lfs_err = lfs_file_seek(_lfs, &file,
+                          sizeof(struct RomCatalogHeader) +
+                              (rom * sizeof(struct RomCatalogEntry)),
+                          LFS_SEEK_SET);
+  if (lfs_err >= 0) {
+    lfs_err = lfs_file_read(_lfs, &file, &entry, sizeof(entry));
+  }
+  lfs_file_close(_lfs, &file);
+  PRINTASSURE(lfs_err == sizeof(entry), "Error reading catalog %d\n",
+              lfs_err);
+
+  memcpy(outRomInfo->name, entry.name, 16);
+  outRomInfo->name[16] = 0;
+  outRomInfo->numRomBanks = entry.numBanks;
+  outRomInfo->firstBank = RomBankToPointer(entry.firstBank);
+  outRomInfo->numRamBanks = entry.numRamBanks;
+  outRomInfo->mbc = entry.mbc;
+  outRomInfo->speedSwitchBank = entry.speedSwitchBank;
 
 error:
-  lfs_dir_close(_lfs, &dir);
   return err;
 }
 
@@ -233,7 +407,7 @@ int RomStorage_StartNewRomTransfer(uint16_t num_banks, uint16_t speedSwitchBank,
     return -1;
   }
 
-  _romInfoFile.magic = ROMINFO_FILE_MAGIC;
+  _romInfoFile.magic = ROMINFO_FILE_MAGIC_CRC;
   _romInfoFile.numBanks = num_banks;
   _romInfoFile.speedSwitchBank = speedSwitchBank;
   memcpy(_romInfoFile.name, name, sizeof(_romInfoFile.name) - 1);
@@ -256,29 +430,60 @@ int RomStorage_StartNewRomTransfer(uint16_t num_banks, uint16_t speedSwitchBank,
   printf("Allocated %d banks for new ROM %s\n", num_banks, name);
   printf("ROM uses bank %d for speed switch\n", speedSwitchBank);
 
-  for (size_t i = 0; i < num_banks; i++) {
-    uint32_t flashAddr = (_romInfoFile.banks[i] * GB_ROM_BANK_SIZE) +
-                         ROM_STORAGE_FLASH_START_ADDR;
-
-    printf("Erasing bank %d @%x\n", _romInfoFile.banks[i], flashAddr);
-    uint32_t ints = save_and_disable_interrupts();
-    flash_range_erase(flashAddr, GB_ROM_BANK_SIZE);
-    restore_interrupts(ints);
-  }
-
   _romTransferActive = true;
   _lastTransferredChunk = 0xFFFF;
   _lastTransferredBank = 0xFFFF;
+  _receivedBankCrc = 0xFFFFFFFF;
 
   return 0;
 }
 
-int RomStorage_TransferRomChunk(uint16_t bank, uint16_t chunk,
-                                const uint8_t data[32]) {
-
+/*
+ * Writes the info file of a completely transferred ROM. A partially written
+ * file is removed again, so it can't end up in the catalog.
+ */
+static int writeRomInfoFile() {
+  int err = 0;
   lfs_file_t file;
-  int lfs_err;
 
+  int lfs_err = lfs_file_opencfg(_lfs, &file, _fileNameBuffer,
+                                 LFS_O_WRONLY | LFS_O_CREAT | LFS_O_EXCL,
+                                 &_fileconfig);
+  if (lfs_err != LFS_ERR_OK) {
+    // the file might belong to another ROM, so it is not removed
+    printf("Error opening file %d\n", lfs_err);
+    return -1;
+  }
+
+  lfs_err = lfs_file_write(_lfs, &file, &_romInfoFile,
+                           offsetof(struct RomInfoFile, banks));
+  PRINTASSURE(lfs_err >= 0, "Error writing header %d\n", lfs_err);
+
+  lfs_err = lfs_file_write(_lfs, &file, &_romInfoFile.banks,
+                           _romInfoFile.numBanks * sizeof(uint16_t));
+  PRINTASSURE(lfs_err >= 0, "Error writing bank info %d\n", lfs_err);
+
+  lfs_err = lfs_file_write(_lfs, &file, &_romInfoFile.bankCrcs,
+                           _romInfoFile.numBanks * sizeof(uint32_t));
+  PRINTASSURE(lfs_err >= 0, "Error writing bank CRCs %d\n", lfs_err);
+
+  lfs_err = lfs_file_close(_lfs, &file);
+  if (lfs_err < 0) {
+    printf("Error closing file %d\n", lfs_err);
+    lfs_remove(_lfs, _fileNameBuffer);
+    return -1;
+  }
+
+  return 0;
+
+error:
+  lfs_file_close(_lfs, &file);
+  lfs_remove(_lfs, _fileNameBuffer);
+  return err;
+}
+
+int RomStorage_TransferRomChunk(uint16_t bank, uint16_t chunk,
+                                const uint8_t data[32]) {
   if (!_romTransferActive) {
     return -1;
   }
@@ -310,7 +515,25 @@ int RomStorage_TransferRomChunk(uint16_t bank, uint16_t chunk,
     return -1;
   }
 
-  memcpy(&_bankBuffer[chunk * TRANSFER_CHUNK_SIZE], data, TRANSFER_CHUNK_SIZE);
+  const uint32_t offset = chunk * TRANSFER_CHUNK_SIZE;
+  const uint32_t flashAddr = (_romInfoFile.banks[bank] * GB_ROM_BANK_SIZE) +
+                             ROM_STORAGE_FLASH_START_ADDR + offset;
+
+  if ((offset % FLASH_SECTOR_SIZE) == 0) {
+    uint32_t ints = save_and_disable_interrupts();
+    flash_range_erase(flashAddr, FLASH_SECTOR_SIZE);
+    restore_interrupts(ints);
+  }
+
+  memcpy(&_pageBuffer[offset % FLASH_PAGE_SIZE], data, TRANSFER_CHUNK_SIZE);
+  _receivedBankCrc = lfs_crc(_receivedBankCrc, data, TRANSFER_CHUNK_SIZE);
+
+  if (((offset + TRANSFER_CHUNK_SIZE) % FLASH_PAGE_SIZE) == 0) {
+    uint32_t ints = save_and_disable_interrupts();
+    flash_range_program(flashAddr & ~(FLASH_PAGE_SIZE - 1), _pageBuffer,
+                        FLASH_PAGE_SIZE);
+    restore_interrupts(ints);
+  }
 
   _lastTransferredBank = bank;
   _lastTransferredChunk = chunk;
@@ -319,41 +542,32 @@ int RomStorage_TransferRomChunk(uint16_t bank, uint16_t chunk,
     _lastTransferredChunk = 0xFFFF;
     printf("Transfer of bank %d completed\n", bank);
 
-    uint32_t flashAddr = (_romInfoFile.banks[bank] * GB_ROM_BANK_SIZE) +
-                         ROM_STORAGE_FLASH_START_ADDR;
-    printf("Writing bank %d @%x\n", _romInfoFile.banks[bank], flashAddr);
-    uint32_t ints = save_and_disable_interrupts();
-    flash_range_program(flashAddr, _bankBuffer, GB_ROM_BANK_SIZE);
-    restore_interrupts(ints);
+    // lfs_crc leaves out the final inversion of CRC-32
+    const uint32_t receivedCrc = ~_receivedBankCrc;
+    _receivedBankCrc = 0xFFFFFFFF;
+
+    const uint32_t flashCrc = GbDma_Crc32(
+        0, RomBankToPointer(_romInfoFile.banks[bank]), GB_ROM_BANK_SIZE);
+    if (flashCrc != receivedCrc) {
+      printf("Bank %d verification failed, CRC %x != %x\n", bank, flashCrc,
+             receivedCrc);
+      RomStorage_AbortRomTransfer();
+      return -1;
+    }
+    _romInfoFile.bankCrcs[bank] = flashCrc;
 
     if (bank == (_romInfoFile.numBanks - 1)) {
       printf("Transfer of ROM completed\n");
 
-      lfs_err = lfs_file_opencfg(_lfs, &file, _fileNameBuffer,
-                                 LFS_O_WRONLY | LFS_O_CREAT | LFS_O_EXCL,
-                                 &_fileconfig);
-
-      lfs_err = lfs_file_write(_lfs, &file, &_romInfoFile,
-                               offsetof(struct RomInfoFile, banks));
-      if (lfs_err < 0) {
-        printf("Error writing header %d\n", lfs_err);
-        return -1;
-      }
-
-      lfs_err = lfs_file_write(_lfs, &file, &_romInfoFile.banks,
-                               _romInfoFile.numBanks * sizeof(uint16_t));
-      if (lfs_err < 0) {
-        printf("Error writing bank info %d\n", lfs_err);
-        return -1;
-      }
+      invalidateRomCatalog();
 
-      lfs_err = lfs_file_close(_lfs, &file);
-      if (lfs_err < 0) {
-        printf("Error closing file %d\n", lfs_err);
+      if (writeRomInfoFile() != 0) {
+        RomStorage_AbortRomTransfer();
+        rebuildRomCatalog();
         return -1;
       }
 
-      RomStorage_init(_lfs); // reinit to reload ROM info
+      rebuildRomCatalog(); // reload ROM info
 
       _romTransferActive = false;
     }
@@ -364,6 +578,60 @@ int RomStorage_TransferRomChunk(uint16_t bank, uint16_t chunk,
 
 uint16_t RomStorage_GetNumUsedBanks() { return _usedBanks; }
 
+bool RomStorage_IsRomTransferActive() { return _romTransferActive; }
+
+/*
+ * Ends an incomplete ROM transfer. No ROM info file was written yet, so only
+ * the banks allocated for it need to be given back.
+ */
+void RomStorage_AbortRomTransfer() {
+  if (!_romTransferActive) {
+    return;
+  }
+
+  printf("Aborting transfer of %s\n", _romInfoFile.name);
+
+  for (size_t i = 0; i < _romInfoFile.numBanks; i++) {
+    ClearBit(_usedBanksFlags, _romInfoFile.banks[i]);
+  }
+
+  _romTransferActive = false;
+}
+
+int RomStorage_GetBankCrc(uint8_t rom, uint16_t bank, uint32_t *crc) {
+  int err = 0;
+  int lfs_err;
+  lfs_file_t file;
+  struct RomInfo romInfo = {};
+
+  // the info of the ROM in transfer would be overwritten
+  if (_romTransferActive) {
+    return -1;
+  }
+
+  ASSURE(!RomStorage_loadRomInfo(rom, &romInfo));
+
+  memcpy(&_fileNameBuffer[6], romInfo.name, 17);
+
+  lfs_err = lfs_file_opencfg(_lfs, &file, _fileNameBuffer, LFS_O_RDONLY,
+                             &_fileconfig);
+  PRINTASSURE(lfs_err == LFS_ERR_OK, "Error opening file %d\n", lfs_err);
+
+  lfs_err = readRomInfoFile(&file);
+  lfs_file_close(_lfs, &file);
+  ASSURE(lfs_err == LFS_ERR_OK);
+
+  if ((_romInfoFile.magic != ROMINFO_FILE_MAGIC_CRC) ||
+      (bank >= _romInfoFile.numBanks)) {
+    return -2;
+  }
+
+  *crc = _romInfoFile.bankCrcs[bank];
+
+error:
+  return err;
+}
+
 int RomStorage_DeleteRom(uint8_t rom) {
   int err = 0;
   int lfs_err = 0;
@@ -381,16 +649,21 @@ int RomStorage_DeleteRom(uint8_t rom) {
   printf("Deleting ROM %d, %s\n", rom, _fileNameBuffer);
   printf("Deleting savegame %s\n", _filenamebufferSaves);
 
+  SaveSlot_Remove(_lfs, romInfo.name);
+
+  strcat(_filenamebufferSaves, BANK_PROFILE_FILE_SUFFIX);
   lfs_err = lfs_remove(_lfs, _filenamebufferSaves);
-  if (lfs_err < 0) {
-    printf("Error deleting savegame file %d\n", lfs_err);
+  if ((lfs_err < 0) && (lfs_err != LFS_ERR_NOENT)) {
+    printf("Error deleting bank profile %d\n", lfs_err);
   }
 
+  invalidateRomCatalog();
+
   lfs_err = lfs_remove(_lfs, _fileNameBuffer);
   PRINTASSURE(lfs_err >= 0, "Error deleting ROM file %d\n", lfs_err);
 
 error:
-  err = RomStorage_init(_lfs); // reinit to reload ROM info
+  err = rebuildRomCatalog(); // reload ROM info
   return err;
 }
 
@@ -418,7 +691,15 @@ int RomStorage_StartRamDownload(uint8_t rom) {
 
   _ramTransferActive = true;
 
-  memcpy(&_filenamebufferSaves[6], g_loadedRomInfo.name, 17);
+  struct SaveSlotRecord records[2];
+  const int newest = SaveSlot_FindNewest(_lfs, g_loadedRomInfo.name, records);
+  SaveSlot_FileName(_filenamebufferSaves, g_loadedRomInfo.name,
+                    (newest == SAVE_SLOT_NONE) ? 0 : newest);
+  _ramDownloadRle = (newest != SAVE_SLOT_NONE) &&
+                    (records[newest].flags & SAVE_SLOT_FLAG_RLE);
+  _ramDownloadBufferPos = 0;
+  _ramDownloadBufferLen = 0;
+  SaveSlot_RleDecoderInit(&_ramDownloadDecoder, NULL, 0);
 
   printf("Loading savefile %d, %s\n", rom, _filenamebufferSaves);
 
@@ -436,11 +717,40 @@ error:
   return err;
 }
 
+static int readRleChunk(uint8_t data[32]) {
+  // a run can continue from the last chunk
+  _ramDownloadDecoder.out = data;
+  _ramDownloadDecoder.outLeft = 32;
+
+  while (_ramDownloadDecoder.outLeft > 0) {
+    if (_ramDownloadBufferPos == _ramDownloadBufferLen) {
+      const int lfs_err =
+          lfs_file_read(_lfs, &_ramTransferFile, _ramDownloadBuffer,
+                        sizeof(_ramDownloadBuffer));
+      if (lfs_err <= 0) {
+        return lfs_err;
+      }
+      _ramDownloadBufferPos = 0;
+      _ramDownloadBufferLen = lfs_err;
+    }
+
+    _ramDownloadBufferPos += SaveSlot_RleDecode(
+        &_ramDownloadDecoder, &_ramDownloadBuffer[_ramDownloadBufferPos],
+        _ramDownloadBufferLen - _ramDownloadBufferPos);
+  }
+
+  return 32;
+}
+
 int RomStorage_GetRamDownloadChunk(uint8_t data[32], uint16_t *bank,
                                    uint16_t *chunk) {
   int lfs_err;
 
-  lfs_err = lfs_file_read(_lfs, &_ramTransferFile, data, 32);
+  if (_ramDownloadRle) {
+    lfs_err = readRleChunk(data);
+  } else {
+    lfs_err = lfs_file_read(_lfs, &_ramTransferFile, data, 32);
+  }
 
   if (lfs_err != 32) {
     printf("Error reading RAM chunk %d\n", lfs_err);
@@ -488,12 +798,17 @@ int RomStorage_StartRamUpload(uint8_t rom) {
 
   _ramTransferActive = true;
 
-  memcpy(&_filenamebufferSaves[6], g_loadedRomInfo.name, 17);
+  // the upload goes to the older slot and becomes the newest one
+  struct SaveSlotRecord records[2];
+  const int newest = SaveSlot_FindNewest(_lfs, g_loadedRomInfo.name, records);
+  SaveSlot_FileName(_filenamebufferSaves, g_loadedRomInfo.name,
+                    (newest == 1) ? 0 : 1);
 
   printf("Opening savefile %d, %s\n", rom, _filenamebufferSaves);
 
   lfs_err = lfs_file_opencfg(_lfs, &_ramTransferFile, _filenamebufferSaves,
-                             LFS_O_WRONLY | LFS_O_CREAT, &_fileconfig);
+                             LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC,
+                             &_fileconfig);
 
   PRINTASSURE(lfs_err == LFS_ERR_OK, "Error opening file %d\n", lfs_err);
 
@@ -502,6 +817,13 @@ int RomStorage_StartRamUpload(uint8_t rom) {
                             ? GB_MBC2_RAM_SIZE
                             : g_loadedRomInfo.numRamBanks * GB_RAM_BANK_SIZE;
 
+  _ramUploadRecord.magic = SAVE_SLOT_RECORD_MAGIC;
+  _ramUploadRecord.sequence =
+      (newest == SAVE_SLOT_NONE) ? 1 : records[newest].sequence + 1;
+  _ramUploadRecord.length = _ramBytesToTransfer;
+  _ramUploadRecord.flags = 0;
+  _ramUploadRecord.crc = 0;
+
 error:
   return err;
 }
@@ -534,11 +856,18 @@ int RomStorage_TransferRamUploadChunk(uint16_t bank, uint16_t chunk,
     return -4;
   }
 
+  _ramUploadRecord.crc = SaveSlot_Crc32(_ramUploadRecord.crc, data, 32);
   _ramBytesTransferred += 32;
 
   if (_ramBytesTransferred >= _ramBytesToTransfer) {
     printf("RAM transfer finished\n");
 
+    lfs_err = lfs_file_write(_lfs, &_ramTransferFile, &_ramUploadRecord,
+                             sizeof(_ramUploadRecord));
+    if (lfs_err != sizeof(_ramUploadRecord)) {
+      printf("Error writing commit record %d\n", lfs_err);
+    }
+
     lfs_file_close(_lfs, &_ramTransferFile);
 
     _ramBytesTransferred = 0;
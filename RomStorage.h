@@ -20,6 +20,7 @@
 
 #include "GlobalDefines.h"
 #include <lfs.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 int RomStorage_init(lfs_t *lfs);
@@ -34,6 +35,12 @@ int RomStorage_TransferRomChunk(uint16_t bank, uint16_t chunk,
 
 uint16_t RomStorage_GetNumUsedBanks();
 
+bool RomStorage_IsRomTransferActive();
+
+void RomStorage_AbortRomTransfer();
+
+int RomStorage_GetBankCrc(uint8_t rom, uint16_t bank, uint32_t *crc);
+
 int RomStorage_DeleteRom(uint8_t rom);
 
 int RomStorage_StartRamUpload(uint8_t rom);
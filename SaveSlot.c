@@ -0,0 +1,259 @@
+/* RP2040 GameBoy cartridge
+ * Copyright (C) 2024 Sebastian Quilitz
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "SaveSlot.h"
+
+#include <hardware/gpio.h>
+#include <lfs_pico_hal.h>
+#include <lfs_util.h>
+#include <pico/platform.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "GbDma.h"
+#include "GlobalDefines.h"
+
+#define SAVE_SLOT_B_FILE_SUFFIX ".b"
+
+/*
+ * The encoded image is a sequence of blocks, each starting with a control
+ * byte. 0x00-0x7F: the next control + 1 bytes are copied. 0x80-0xFF: the next
+ * byte is repeated control - 0x80 + 3 times.
+ */
+#define RLE_MAX_LITERALS 128U
+#define RLE_MIN_REPEATS 3U
+#define RLE_MAX_REPEATS (0x7FU + RLE_MIN_REPEATS)
+#define RLE_REPEAT_BIT 0x80U
+
+static uint8_t _lfsFileBuffer[LFS_CACHE_SIZE];
+
+void SaveSlot_FileName(char *buffer, const char *romName, uint8_t slot) {
+  strcpy(buffer, "saves/");
+  strcat(buffer, romName);
+  if (slot == 1) {
+    strcat(buffer, SAVE_SLOT_B_FILE_SUFFIX);
+  }
+}
+
+static bool readRecord(lfs_t *lfs, const char *romName, uint8_t slot,
+                       struct SaveSlotRecord *record) {
+  lfs_file_t file;
+  struct lfs_file_config fileconfig = {.buffer = _lfsFileBuffer};
+  char filenamebuffer[40];
+  bool valid = false;
+
+  memset(record, 0, sizeof(*record));
+  SaveSlot_FileName(filenamebuffer, romName, slot);
+
+  if (lfs_file_opencfg(lfs, &file, filenamebuffer, LFS_O_RDONLY,
+                       &fileconfig) != LFS_ERR_OK) {
+    return false;
+  }
+
+  const lfs_soff_t size = lfs_file_size(lfs, &file);
+  if ((size >= (lfs_soff_t)sizeof(*record)) &&
+      (lfs_file_seek(lfs, &file, size - sizeof(*record), LFS_SEEK_SET) >=
+       0) &&
+      (lfs_file_read(lfs, &file, record, sizeof(*record)) ==
+       sizeof(*record))) {
+    valid = (record->magic == SAVE_SLOT_RECORD_MAGIC) &&
+            (record->length == (size - sizeof(*record)));
+  }
+
+  lfs_file_close(lfs, &file);
+
+  if (!valid) {
+    memset(record, 0, sizeof(*record));
+  }
+
+  return valid;
+}
+
+/*
+ * Reads the commit records of both slots and returns the slot with the newest
+ * one, or SAVE_SLOT_NONE if there is no slot with a commit record. Slots
+ * without a valid record have a zeroed record. The image itself is not
+ * checked here, that is done when it is read.
+ */
+int SaveSlot_FindNewest(lfs_t *lfs, const char *romName,
+                        struct SaveSlotRecord records[2]) {
+  const bool validA = readRecord(lfs, romName, 0, &records[0]);
+  const bool validB = readRecord(lfs, romName, 1, &records[1]);
+
+  if (validA && validB) {
+    return ((int32_t)(records[1].sequence - records[0].sequence) > 0) ? 1 : 0;
+  } else if (validA) {
+    return 0;
+  } else if (validB) {
+    return 1;
+  }
+
+  return SAVE_SLOT_NONE;
+}
+
+int SaveSlot_Remove(lfs_t *lfs, const char *romName) {
+  char filenamebuffer[40];
+  int err = LFS_ERR_OK;
+
+  for (uint8_t slot = 0; slot < 2; slot++) {
+    SaveSlot_FileName(filenamebuffer, romName, slot);
+    const int lfs_err = lfs_remove(lfs, filenamebuffer);
+    if ((lfs_err < 0) && (lfs_err != LFS_ERR_NOENT)) {
+      printf("Error deleting %s %d\n", filenamebuffer, lfs_err);
+      err = lfs_err;
+    }
+  }
+
+  return err;
+}
+
+/*
+ * CRC-32 as used by zlib. The DMA sniffer can only be borrowed while the
+ * GameBoy is held in reset, otherwise littlefs' software CRC is used, which
+ * leaves out the final inversion.
+ */
+uint32_t SaveSlot_Crc32(uint32_t crc, const void *data, size_t len) {
+  if (gpio_get_out_level(PIN_GB_RESET)) {
+    return GbDma_Crc32(crc, data, len);
+  }
+
+  return ~lfs_crc(~crc, data, len);
+}
+
+static uint32_t rleRunLength(const uint8_t *data, uint32_t len) {
+  uint32_t run = 1;
+  while ((run < len) && (run < RLE_MAX_REPEATS) && (data[run] == data[0])) {
+    run++;
+  }
+  return run;
+}
+
+/*
+ * Encodes len bytes at data and passes the result to write in pieces of up to
+ * the size of a local buffer. Without write, the encoded length is only
+ * counted. Returns the encoded length or the first error of write.
+ */
+int SaveSlot_RleEncode(const uint8_t *data, uint32_t len, SaveSlotWriter write,
+                       void *context) {
+  uint8_t buffer[RLE_MAX_LITERALS + 1];
+  uint32_t pos = 0;
+  int encoded = 0;
+
+  while (pos < len) {
+    uint32_t blockLen;
+    const uint32_t run = rleRunLength(&data[pos], len - pos);
+
+    if (run >= RLE_MIN_REPEATS) {
+      buffer[0] = RLE_REPEAT_BIT | (run - RLE_MIN_REPEATS);
+      buffer[1] = data[pos];
+      blockLen = 2;
+      pos += run;
+    } else {
+      // literals up to the next run which is worth encoding
+      uint32_t literals = run;
+      while (((pos + literals) < len) && (literals < RLE_MAX_LITERALS)) {
+        const uint32_t next =
+            rleRunLength(&data[pos + literals], len - pos - literals);
+        if (next >= RLE_MIN_REPEATS) {
+          break;
+        }
+        literals = MIN(literals + next, RLE_MAX_LITERALS);
+      }
+
+      buffer[0] = literals - 1;
+      if (write) {
+        memcpy(&buffer[1], &data[pos], literals);
+      }
+      blockLen = literals + 1;
+      pos += literals;
+    }
+
+    if (write) {
+      const int err = write(context, buffer, blockLen);
+      if (err < 0) {
+        return err;
+      }
+    }
+    encoded += blockLen;
+  }
+
+  return encoded;
+}
+
+void SaveSlot_RleDecoderInit(struct SaveSlotRleDecoder *decoder, uint8_t *out,
+                             uint32_t len) {
+  memset(decoder, 0, sizeof(*decoder));
+  decoder->out = out;
+  decoder->outLeft = len;
+}
+
+/*
+ * Decodes from len bytes at in until either the input is used up or the output
+ * is full. Returns the number of input bytes used.
+ */
+size_t SaveSlot_RleDecode(struct SaveSlotRleDecoder *decoder, const uint8_t *in,
+                          size_t len) {
+  size_t used = 0;
+
+  while (decoder->outLeft > 0) {
+    if (decoder->literals > 0) {
+      if (used == len) {
+        break;
+      }
+      const uint32_t n =
+          MIN(MIN(decoder->literals, len - used), decoder->outLeft);
+      memcpy(decoder->out, &in[used], n);
+      decoder->out += n;
+      decoder->outLeft -= n;
+      decoder->literals -= n;
+      used += n;
+    } else if (decoder->repeats > 0) {
+      if (!decoder->haveValue) {
+        if (used == len) {
+          break;
+        }
+        decoder->value = in[used++];
+        decoder->haveValue = true;
+      }
+      const uint32_t n = MIN(decoder->repeats, decoder->outLeft);
+      memset(decoder->out, decoder->value, n);
+      decoder->out += n;
+      decoder->outLeft -= n;
+      decoder->repeats -= n;
+    } else {
+      if (used == len) {
+        break;
+      }
+      const uint8_t control = in[used++];
+      if (control & RLE_REPEAT_BIT) {
+        decoder->repeats = (control & ~RLE_REPEAT_BIT) + RLE_MIN_REPEATS;
+        decoder->haveValue = false;
+      } else {
+        decoder->literals = control + 1;
+      }
+    }
+  }
+
+  return used;
+}
+
+bool SaveSlot_RleDecoderFinished(const struct SaveSlotRleDecoder *decoder) {
+  return (decoder->outLeft == 0) && (decoder->literals == 0) &&
+         (decoder->repeats == 0);
+}
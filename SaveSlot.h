@@ -0,0 +1,78 @@
+/* RP2040 GameBoy cartridge
+ * Copyright (C) 2024 Sebastian Quilitz
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef E4A92C17_8B3D_4F06_A5C1_2D7E9F30B864
+#define E4A92C17_8B3D_4F06_A5C1_2D7E9F30B864
+
+#include <lfs.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SAVE_SLOT_RECORD_MAGIC 0x53415645U
+#define SAVE_SLOT_NONE -1
+
+/* the image is run length encoded, see SaveSlot_RleEncode */
+#define SAVE_SLOT_FLAG_RLE 0x01U
+
+/*
+ * A save is kept in two slot files, saves/<name> and saves/<name>.b. New saves
+ * always go to the older slot, so a save which did not complete never replaces
+ * the last good one. The commit record is written after the image, so an
+ * incomplete slot has no valid record. The slot with the higher sequence
+ * number is the newest.
+ */
+struct SaveSlotRecord {
+  uint32_t magic;
+  uint32_t sequence;
+  uint32_t length; // bytes of the image stored in front of the record
+  uint32_t flags;  // SAVE_SLOT_FLAG_* bits
+  uint32_t crc;    // CRC-32 of the save RAM image, before encoding
+};
+
+typedef int (*SaveSlotWriter)(void *context, const void *data, size_t len);
+
+/*
+ * State of a decoder which can be fed with any piece of the encoded image and
+ * stops as soon as its output is full, so the image can be decoded straight
+ * from a file into the save RAM or into small chunks.
+ */
+struct SaveSlotRleDecoder {
+  uint8_t *out;
+  uint32_t outLeft;
+  uint8_t literals; // bytes still to copy from the input
+  uint8_t repeats;  // times value still has to be written
+  bool haveValue;
+  uint8_t value;
+};
+
+void SaveSlot_FileName(char *buffer, const char *romName, uint8_t slot);
+int SaveSlot_FindNewest(lfs_t *lfs, const char *romName,
+                        struct SaveSlotRecord records[2]);
+int SaveSlot_Remove(lfs_t *lfs, const char *romName);
+uint32_t SaveSlot_Crc32(uint32_t crc, const void *data, size_t len);
+
+int SaveSlot_RleEncode(const uint8_t *data, uint32_t len, SaveSlotWriter write,
+                       void *context);
+void SaveSlot_RleDecoderInit(struct SaveSlotRleDecoder *decoder, uint8_t *out,
+                             uint32_t len);
+size_t SaveSlot_RleDecode(struct SaveSlotRleDecoder *decoder, const uint8_t *in,
+                          size_t len);
+bool SaveSlot_RleDecoderFinished(const struct SaveSlotRleDecoder *decoder);
+
+#endif /* E4A92C17_8B3D_4F06_A5C1_2D7E9F30B864 */
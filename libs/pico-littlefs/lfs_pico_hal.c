@@ -11,10 +11,13 @@
 
 #include <limits.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 
 #include "hardware/flash.h"
 #include "hardware/regs/addressmap.h"
 #include "hardware/sync.h"
+#include "hardware/timer.h"
 #if LIB_PICO_MULTICORE
 #include "pico/mutex.h"
 #endif
@@ -30,6 +33,8 @@ uint8_t readBuffer[LFS_CACHE_SIZE];
 uint8_t programBuffer[LFS_CACHE_SIZE];
 uint8_t lookaheadBuffer[LOOK_AHEAD_SIZE] __attribute__((aligned(4)));
 
+struct pico_hal_stats pico_stats;
+
 static int pico_hal_read(const struct lfs_config *c, lfs_block_t block,
                          lfs_off_t off, void *buffer, lfs_size_t size);
 static int pico_hal_prog(const struct lfs_config *c, lfs_block_t block,
@@ -74,10 +79,14 @@ static int pico_hal_read(const struct lfs_config *c, lfs_block_t block,
                          lfs_off_t off, void *buffer, lfs_size_t size) {
   assert(block < c->block_count);
   assert(off + size <= c->block_size);
+  uint32_t start = time_us_32();
   // read flash via XIP mapped space
   memcpy(buffer,
          FS_BASE + XIP_NOCACHE_NOALLOC_BASE + (block * c->block_size) + off,
          size);
+  pico_stats.reads++;
+  pico_stats.read_bytes += size;
+  pico_stats.read_us += time_us_32() - start;
   return LFS_ERR_OK;
 }
 
@@ -86,9 +95,13 @@ static int pico_hal_prog(const struct lfs_config *c, lfs_block_t block,
   assert(block < c->block_count);
   // program with SDK
   uint32_t p = (uint32_t)FS_BASE + (block * c->block_size) + off;
+  uint32_t start = time_us_32();
   uint32_t ints = save_and_disable_interrupts();
   flash_range_program(p, buffer, size);
   restore_interrupts(ints);
+  pico_stats.progs++;
+  pico_stats.prog_bytes += size;
+  pico_stats.prog_us += time_us_32() - start;
   return LFS_ERR_OK;
 }
 
@@ -96,9 +109,12 @@ static int pico_hal_erase(const struct lfs_config *c, lfs_block_t block) {
   assert(block < c->block_count);
   // erase with SDK
   uint32_t p = (uint32_t)FS_BASE + block * c->block_size;
+  uint32_t start = time_us_32();
   uint32_t ints = save_and_disable_interrupts();
   flash_range_erase(p, c->block_size);
   restore_interrupts(ints);
+  pico_stats.erases++;
+  pico_stats.erase_us += time_us_32() - start;
   return LFS_ERR_OK;
 }
 
@@ -124,6 +140,16 @@ static int pico_unlock(void) {
 
 // utility functions
 
+void pico_hal_reset_stats(void) { memset(&pico_stats, 0, sizeof(pico_stats)); }
+
+void pico_hal_print_stats(const char *what) {
+  printf("%s: %lu reads (%lu bytes, %lu us), %lu progs (%lu bytes, %lu us), "
+         "%lu erases (%lu us)\n",
+         what, pico_stats.reads, pico_stats.read_bytes, pico_stats.read_us,
+         pico_stats.progs, pico_stats.prog_bytes, pico_stats.prog_us,
+         pico_stats.erases, pico_stats.erase_us);
+}
+
 const char *pico_errmsg(int err) {
   static const struct {
     int err;
@@ -4,9 +4,28 @@
 #include "lfs.h"
 
 #include <hardware/flash.h>
+#include <stdint.h>
 
 #define LFS_CACHE_SIZE (FLASH_SECTOR_SIZE / 4)
 
 extern struct lfs_config pico_cfg;
 
+// statistics of the block device operations, to see how long littlefs
+// keeps the flash busy
+struct pico_hal_stats {
+  uint32_t reads;
+  uint32_t progs;
+  uint32_t erases;
+  uint32_t read_bytes;
+  uint32_t prog_bytes;
+  uint32_t read_us;
+  uint32_t prog_us;
+  uint32_t erase_us;
+};
+
+extern struct pico_hal_stats pico_stats;
+
+void pico_hal_reset_stats(void);
+void pico_hal_print_stats(const char *what);
+
 #endif /* LFS_PICO_HAL_H */
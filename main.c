@@ -47,6 +47,9 @@
 #include <git_commit.h>
 
 #include "BuildVersion.h"
+#include "BusTrace.h"
+#include "Core1.h"
+#include "FlashSsi.h"
 #include "GameBoyHeader.h"
 #include "GbRtc.h"
 #include "gb-bootloader/gbbootloader.h"
@@ -55,6 +58,7 @@
 #include "GbDma.h"
 #include "GlobalDefines.h"
 #include "RomStorage.h"
+#include "SaveSlot.h"
 #include "mbc.h"
 #include "webusb.h"
 #include "ws2812b_spi.h"
@@ -88,6 +92,8 @@ uint8_t g_flashSerialNumber[FLASH_UNIQUE_ID_SIZE_BYTES];
 char g_serialNumberString[(FLASH_UNIQUE_ID_SIZE_BYTES * 2) + 1];
 
 struct RomInfo __attribute__((section(".noinit."))) g_loadedRomInfo;
+uint32_t __attribute__((section(".noinit.")))
+g_saveRamDirtyPages[SAVE_RAM_NUM_PAGES / 32];
 
 static uint32_t __attribute__((section(".noinit."))) _noInitTest;
 static uint32_t __attribute__((section(".noinit."))) _lastRunningGame;
@@ -101,6 +107,7 @@ static uint16_t _mainStateMachineCopy
     [sizeof(gameboy_bus_double_speed_program_instructions) / sizeof(uint16_t)];
 
 void runGbBootloader(uint8_t *selectedGame, uint8_t *selectedGameMode);
+void printPioTimingMargins();
 void loadLastTimestampFromFile(uint64_t *ts);
 void storeLastTimestampToFile(const uint64_t *ts);
 
@@ -111,7 +118,7 @@ int main() {
   {
     vreg_set_voltage(VREG_VOLTAGE_1_15);
     sleep_ms(2);
-    set_sys_clock_khz(266000, true);
+    set_sys_clock_khz(SYSCLK_MHZ * 1000, true);
     sleep_ms(2);
   }
 
@@ -131,6 +138,8 @@ int main() {
            g_flashSerialNumber[7]);
 
   printf("SSI->BAUDR: %x\n", *((uint32_t *)(XIP_SSI_BASE + SSI_BAUDR_OFFSET)));
+  FlashSsi_Init();
+  printPioTimingMargins();
 
   gpio_init(PIN_GB_RESET);
   if (gpio_get(PIN_GB_RESET)) {
@@ -239,7 +248,8 @@ int main() {
   if (lfs_err != LFS_ERR_OK) {
     printf("Final error mounting FS %d\n", lfs_err);
   } else {
-    printf("mounted\n");
+    printf("mounted, %d of %d blocks in use\n", lfs_fs_size(&_lfs),
+           pico_cfg.block_count);
   }
 
   lfs_err = lfs_mkdir(&_lfs, "/saves");
@@ -251,10 +261,18 @@ int main() {
     printf("Error creating rtc directory %d\n", lfs_err);
   }
 
+  FlashSsi_LoadOrCalibrateTiming(&_lfs);
+  GbDma_PrintChainCosts();
+
   RomStorage_init(&_lfs);
 
   if (_lastRunningGame < g_numRoms) {
     printf("Game %d was running before reset\n", _lastRunningGame);
+    printMbcProfile();
+    BusTrace_PrintSummary();
+    storeBankProfile();
+
+    pico_hal_reset_stats();
 
     if (GameBoyHeader_hasRtc(g_loadedRomInfo.firstBank)) {
       storeRtcToFile(&g_loadedRomInfo);
@@ -264,6 +282,8 @@ int main() {
       storeSaveRamToFile(&g_loadedRomInfo);
     }
 
+    pico_hal_print_stats("save after reset");
+
     _lastRunningGame = 0xFF;
 
     g_globalTimestamp = g_rtcTimestamp;
@@ -405,6 +425,27 @@ void __no_inline_not_in_flash_func(runGbBootloader)(uint8_t *selectedGame,
   gpio_put(PIN_GB_RESET, 1);
 }
 
+void printPioTimingMargins() {
+  const int addrSampleNs = (ADDR_SAMPLE_CYCLES * 1000) / SYSCLK_MHZ;
+  const int addrSampleNsDoubleSpeed =
+      (ADDR_SAMPLE_CYCLES_DOUBLE_SPEED * 1000) / SYSCLK_MHZ;
+  const int addrSampleNsWritesOnly =
+      (ADDR_SAMPLE_CYCLES_WRITES_ONLY * 1000) / SYSCLK_MHZ;
+
+  /*
+   * The address needs to be sampled while CLK is still high, so the time left
+   * until the falling edge is the margin the PIO programs have.
+   */
+  printf("PIO addr sample %d ns, margin %d ns\n", addrSampleNs,
+         (GB_BUS_CYCLE_NS / 2) - addrSampleNs);
+  printf("PIO addr sample double speed %d ns, margin %d ns\n",
+         addrSampleNsDoubleSpeed,
+         (GB_BUS_CYCLE_NS_DOUBLE_SPEED / 2) - addrSampleNsDoubleSpeed);
+  printf("PIO addr sample writes only %d ns, margin %d ns\n",
+         addrSampleNsWritesOnly,
+         (GB_BUS_CYCLE_NS / 2) - addrSampleNsWritesOnly);
+}
+
 // format string must be stored in RAM
 char _loadDoubleSpeedPio_printfFormat[] = "ds %x %x\n";
 void __no_inline_not_in_flash_func(loadDoubleSpeedPio)(uint16_t bank,
@@ -451,6 +492,35 @@ void __no_inline_not_in_flash_func(loadDoubleSpeedPio)(uint16_t bank,
   }
 }
 
+_Static_assert(sizeof(gameboy_bus_writes_only_program_instructions) ==
+                   sizeof(gameboy_bus_program_instructions),
+               "writes only program needs to replace the main program");
+_Static_assert(gameboy_bus_writes_only_offset_entry_point ==
+                   gameboy_bus_offset_entry_point,
+               "writes only program needs the same entry point");
+
+void loadWritesOnlyPio() {
+  pio_sm_set_enabled(pio1, SMC_GB_MAIN, false);
+
+  // there is no space left in pio1, so the main program is replaced
+  for (size_t i = 0; i < (sizeof(gameboy_bus_writes_only_program_instructions) /
+                          sizeof(uint16_t));
+       i++) {
+    uint16_t instr = gameboy_bus_writes_only_program_instructions[i];
+    pio1->instr_mem[_offset_main + i] =
+        pio_instr_bits_jmp != _pio_major_instr_bits(instr)
+            ? instr
+            : instr + _offset_main;
+  }
+
+  pio_sm_clear_fifos(pio1, SMC_GB_MAIN);
+  pio_sm_restart(pio1, SMC_GB_MAIN);
+  pio_sm_exec(pio1, SMC_GB_MAIN,
+              pio_encode_jmp(_offset_main +
+                             gameboy_bus_writes_only_offset_entry_point));
+  pio_sm_set_enabled(pio1, SMC_GB_MAIN, true);
+}
+
 void __no_inline_not_in_flash_func(setSsi8bit)() {
   __compiler_memory_barrier();
 
@@ -462,6 +532,10 @@ void __no_inline_not_in_flash_func(setSsi8bit)() {
       (SSI_CTRLR0_TMOD_VALUE_EEPROM_READ /* Send INST/ADDR, Receive Data */
        << SSI_CTRLR0_TMOD_LSB);
 
+  ssi_hw->spi_ctrlr0 = g_flashSsiSpiCtrlr0;
+  ssi_hw->baudr = g_flashSsiBaudr;
+  ssi_hw->rx_sample_dly = g_flashSsiRxSampleDelay;
+
   ssi_hw->dmacr = SSI_DMACR_TDMAE_BITS | SSI_DMACR_RDMAE_BITS;
   ssi_hw->ssienr = 1; // enable SSI again
 }
@@ -475,6 +549,10 @@ void __no_inline_not_in_flash_func(setSsi32bit)() {
       (SSI_CTRLR0_TMOD_VALUE_EEPROM_READ /* Send INST/ADDR, Receive Data */
        << SSI_CTRLR0_TMOD_LSB);
 
+  ssi_hw->spi_ctrlr0 = g_flashSsiSpiCtrlr0;
+  ssi_hw->baudr = g_flashSsiBaudr;
+  ssi_hw->rx_sample_dly = g_flashSsiRxSampleDelay;
+
   ssi_hw->dmacr = 0;
   ssi_hw->ssienr = 1; // enable SSI again
 
@@ -489,65 +567,376 @@ __assert_fail(const char *expr, const char *file, unsigned int line,
     ;
 }
 
-void restoreSaveRamFromFile(const struct RomInfo *romInfo) {
+/*
+ * CRC of the save image which is known to be in the newest slot, because it
+ * was loaded from or written to it. It survives the reset which leaves the
+ * game, so a save RAM which did not change is not written again.
+ */
+#define SAVED_IMAGE_MAGIC 0x43524353U
+
+struct SavedImage {
+  uint32_t magic;
+  char name[17];
+  uint32_t length;
+  uint32_t crc;
+};
+
+static struct SavedImage __attribute__((section(".noinit."))) _savedImage;
+
+static void rememberSavedImage(const struct RomInfo *romInfo, uint32_t length,
+                               uint32_t crc) {
+  _savedImage.magic = SAVED_IMAGE_MAGIC;
+  strcpy(_savedImage.name, romInfo->name);
+  _savedImage.length = length;
+  _savedImage.crc = crc;
+}
+
+static uint8_t *saveRamImage(const struct RomInfo *romInfo, uint32_t *size) {
+  if (romInfo->mbc == 2) {
+    *size = GB_MBC2_RAM_SIZE;
+    return &ram_memory[GB_RAM_BANK_SIZE - GB_MBC2_RAM_SIZE];
+  }
+
+  *size = romInfo->numRamBanks * GB_RAM_BANK_SIZE;
+  return ram_memory;
+}
+
+static int readRleImage(lfs_file_t *file, uint8_t *ram, uint32_t size,
+                        uint32_t length) {
+  struct SaveSlotRleDecoder decoder;
+  uint8_t buffer[128];
+  uint32_t read = 0;
+
+  SaveSlot_RleDecoderInit(&decoder, ram, size);
+
+  while (read < length) {
+    const int lfs_err = lfs_file_read(&_lfs, file, buffer,
+                                      MIN(sizeof(buffer), length - read));
+    if (lfs_err <= 0) {
+      return -1;
+    }
+    read += lfs_err;
+
+    if (SaveSlot_RleDecode(&decoder, buffer, lfs_err) != (size_t)lfs_err) {
+      return -1; // more data than fits into the save RAM
+    }
+  }
+
+  return SaveSlot_RleDecoderFinished(&decoder) ? (int)size : -1;
+}
+
+/*
+ * Reads the image of a slot into the save RAM. If a record is given, the image
+ * must match its length and CRC, otherwise the file is a save of an older
+ * firmware without commit record.
+ */
+static int readSaveSlot(const struct RomInfo *romInfo, uint8_t slot,
+                        const struct SaveSlotRecord *record) {
   lfs_file_t file;
   struct lfs_file_config fileconfig = {.buffer = _lfsFileBuffer};
-  char filenamebuffer[40] = "saves/";
+  char filenamebuffer[40];
+  uint32_t size;
+  uint8_t *ram = saveRamImage(romInfo, &size);
 
-  strcpy(&filenamebuffer[strlen(filenamebuffer)], romInfo->name);
+  SaveSlot_FileName(filenamebuffer, romInfo->name, slot);
+
+  const bool rle = record && (record->flags & SAVE_SLOT_FLAG_RLE);
+
+  if (record && !rle && (record->length != size)) {
+    printf("%s has %d bytes, expected %d\n", filenamebuffer, record->length,
+           size);
+    return -1;
+  }
 
   int lfs_err =
       lfs_file_opencfg(&_lfs, &file, filenamebuffer, LFS_O_RDONLY, &fileconfig);
+  if (lfs_err != LFS_ERR_OK) {
+    return lfs_err;
+  }
 
-  if (lfs_err == LFS_ERR_OK) {
-    printf("found save at %s\n", filenamebuffer);
-
-    if (romInfo->mbc == 2) {
-      lfs_err = lfs_file_read(&_lfs, &file,
-                              &ram_memory[GB_RAM_BANK_SIZE - GB_MBC2_RAM_SIZE],
-                              GB_MBC2_RAM_SIZE);
-    } else {
-      lfs_err = lfs_file_read(&_lfs, &file, ram_memory,
-                              romInfo->numRamBanks * GB_RAM_BANK_SIZE);
+  if (!record && (lfs_file_size(&_lfs, &file) != (lfs_soff_t)size)) {
+    lfs_file_close(&_lfs, &file);
+    return -1;
+  }
+
+  printf("found save at %s\n", filenamebuffer);
+
+  if (rle) {
+    lfs_err = readRleImage(&file, ram, size, record->length);
+  } else {
+    lfs_err = lfs_file_read(&_lfs, &file, ram, size);
+  }
+  lfs_file_close(&_lfs, &file);
+
+  printf("read %d bytes\n", lfs_err);
+
+  if (lfs_err != (int)size) {
+    return -1;
+  }
+
+  if (record && (SaveSlot_Crc32(0, ram, size) != record->crc)) {
+    printf("CRC of %s does not match\n", filenamebuffer);
+    return -1;
+  }
+
+  return 0;
+}
+
+void restoreSaveRamFromFile(const struct RomInfo *romInfo) {
+  struct SaveSlotRecord records[2];
+  const int newest = SaveSlot_FindNewest(&_lfs, romInfo->name, records);
+
+  _savedImage.magic = 0;
+
+  if (newest != SAVE_SLOT_NONE) {
+    if (readSaveSlot(romInfo, newest, &records[newest]) == 0) {
+      uint32_t size;
+      saveRamImage(romInfo, &size);
+      rememberSavedImage(romInfo, size, records[newest].crc);
+      return;
     }
 
-    printf("read %d bytes\n", lfs_err);
+    // not remembered, the newest slot still holds the broken image
+    const uint8_t other = 1 - newest;
+    if ((records[other].magic == SAVE_SLOT_RECORD_MAGIC) &&
+        (readSaveSlot(romInfo, other, &records[other]) == 0)) {
+      return;
+    }
+  }
 
-    if (lfs_err >= 0) {
-      lfs_file_close(&_lfs, &file);
+  // save of an older firmware, without commit record
+  if (records[0].magic != SAVE_SLOT_RECORD_MAGIC) {
+    readSaveSlot(romInfo, 0, NULL);
+  }
+}
+
+/*
+ * Pages written to the newest save slot, so the older slot can be updated by
+ * writing these and the pages written since then.
+ */
+#define SAVE_PAGES_MAGIC 0x50414745U
+
+struct SavePages {
+  uint32_t magic;
+  uint32_t sequence;
+  char name[17];
+  uint32_t pages[SAVE_RAM_NUM_PAGES / 32];
+};
+
+static struct SavePages __attribute__((section(".noinit."))) _lastSavePages;
+
+/*
+ * Only write the pages of the save RAM which are marked in pages. The file
+ * must already hold the complete save.
+ */
+static int writeDirtySaveRamPages(lfs_file_t *file, uint32_t size,
+                                  const uint32_t *pages) {
+  const uint32_t numPages = size / SAVE_RAM_PAGE_SIZE;
+  uint32_t page = 0;
+  int written = 0;
+
+  while (page < numPages) {
+    if (!SAVE_RAM_PAGE_IS_DIRTY(pages, page)) {
+      page++;
+      continue;
     }
+
+    uint32_t end = page + 1;
+    while ((end < numPages) && SAVE_RAM_PAGE_IS_DIRTY(pages, end)) {
+      end++;
+    }
+
+    int lfs_err = lfs_file_seek(&_lfs, file, page * SAVE_RAM_PAGE_SIZE,
+                                LFS_SEEK_SET);
+    if (lfs_err < 0) {
+      return lfs_err;
+    }
+
+    lfs_err = lfs_file_write(&_lfs, file,
+                             &ram_memory[page * SAVE_RAM_PAGE_SIZE],
+                             (end - page) * SAVE_RAM_PAGE_SIZE);
+    if (lfs_err < 0) {
+      return lfs_err;
+    }
+
+    written += lfs_err;
+    page = end;
   }
+
+  return written;
+}
+
+static int writeToSaveFile(void *context, const void *data, size_t len) {
+  return lfs_file_write(&_lfs, context, data, len);
 }
 
 void storeSaveRamToFile(const struct RomInfo *romInfo) {
   lfs_file_t file;
   int lfs_err;
   struct lfs_file_config fileconfig = {.buffer = _lfsFileBuffer};
-  char filenamebuffer[40] = "saves/";
-  strcpy(&filenamebuffer[strlen(filenamebuffer)],
-         (const char *)&(romInfo->name));
+  char filenamebuffer[40];
+  struct SaveSlotRecord records[2];
+  uint32_t size;
+  const uint8_t *ram = saveRamImage(romInfo, &size);
+  const uint32_t crc = SaveSlot_Crc32(0, ram, size);
+
+  if ((_savedImage.magic == SAVED_IMAGE_MAGIC) &&
+      (strcmp(_savedImage.name, romInfo->name) == 0) &&
+      (_savedImage.length == size) && (_savedImage.crc == crc)) {
+    printf("Game RAM unchanged, not saved\n");
+    Core1_SetRgb(0, 0x10, 0); // light up LED in green
+    return;
+  }
+
+  // most saves are largely 0x00 or 0xFF, only encode them if that at least
+  // halves the bytes to program
+  const int rleLength = SaveSlot_RleEncode(ram, size, NULL, NULL);
+  const bool rle = rleLength <= (int)(size / 2);
+
+  const int newest = SaveSlot_FindNewest(&_lfs, romInfo->name, records);
+  const uint8_t slot = (newest == 1) ? 0 : 1;
+  const struct SaveSlotRecord record = {
+      .magic = SAVE_SLOT_RECORD_MAGIC,
+      .sequence =
+          (newest == SAVE_SLOT_NONE) ? 1 : records[newest].sequence + 1,
+      .length = rle ? rleLength : size,
+      .flags = rle ? SAVE_SLOT_FLAG_RLE : 0,
+      .crc = crc,
+  };
+
+  // the older slot holds the save before the newest one, it only misses the
+  // pages written into the newest slot and the ones changed since then
+  const bool incremental =
+      !rle && (romInfo->mbc != 2) && (newest != SAVE_SLOT_NONE) &&
+      (records[slot].magic == SAVE_SLOT_RECORD_MAGIC) &&
+      !(records[slot].flags & SAVE_SLOT_FLAG_RLE) &&
+      (records[slot].length == size) &&
+      (records[slot].sequence == record.sequence - 2) &&
+      (_lastSavePages.magic == SAVE_PAGES_MAGIC) &&
+      (_lastSavePages.sequence == record.sequence - 1) &&
+      (strcmp(_lastSavePages.name, romInfo->name) == 0);
+
+  SaveSlot_FileName(filenamebuffer, romInfo->name, slot);
   printf("Saving game RAM to file %s\n", filenamebuffer);
 
   lfs_err = lfs_file_opencfg(&_lfs, &file, filenamebuffer,
-                             LFS_O_WRONLY | LFS_O_CREAT, &fileconfig);
+                             incremental ? LFS_O_WRONLY
+                                         : LFS_O_WRONLY | LFS_O_CREAT |
+                                               LFS_O_TRUNC,
+                             &fileconfig);
 
   if (lfs_err != LFS_ERR_OK) {
     printf("Error opening file %d\n", lfs_err);
+    return;
   }
 
-  if (romInfo->mbc == 2) {
-    lfs_err = lfs_file_write(&_lfs, &file,
-                             &ram_memory[GB_RAM_BANK_SIZE - GB_MBC2_RAM_SIZE],
-                             GB_MBC2_RAM_SIZE);
+  if (incremental) {
+    uint32_t pages[SAVE_RAM_NUM_PAGES / 32];
+    for (size_t i = 0; i < count_of(pages); i++) {
+      pages[i] = _lastSavePages.pages[i] | g_saveRamDirtyPages[i];
+    }
+    lfs_err = writeDirtySaveRamPages(&file, size, pages);
+    if (lfs_err >= 0) {
+      lfs_file_seek(&_lfs, &file, size, LFS_SEEK_SET);
+    }
+  } else if (rle) {
+    lfs_err = SaveSlot_RleEncode(ram, size, writeToSaveFile, &file);
   } else {
-    lfs_err = lfs_file_write(&_lfs, &file, ram_memory,
-                             romInfo->numRamBanks * GB_RAM_BANK_SIZE);
+    lfs_err = lfs_file_write(&_lfs, &file, ram, size);
   }
   printf("wrote %d bytes\n", lfs_err);
 
+  // the slot only becomes valid with the commit record, which must not be
+  // written if the image is incomplete
+  if (lfs_err >= 0) {
+    lfs_err = lfs_file_write(&_lfs, &file, &record, sizeof(record));
+  }
+
+  lfs_file_close(&_lfs, &file);
+
+  if (lfs_err < 0) {
+    printf("Error writing save %d\n", lfs_err);
+    _lastSavePages.magic = 0;
+    _savedImage.magic = 0;
+    return;
+  }
+
+  rememberSavedImage(romInfo, size, crc);
+
+  _lastSavePages.magic = SAVE_PAGES_MAGIC;
+  _lastSavePages.sequence = record.sequence;
+  strcpy(_lastSavePages.name, romInfo->name);
+  memcpy(_lastSavePages.pages, g_saveRamDirtyPages,
+         sizeof(_lastSavePages.pages));
+
+  Core1_SetRgb(0, 0x10, 0); // light up LED in green
+}
+
+int restoreBankProfileFromFile(const struct RomInfo *romInfo,
+                               uint32_t *selects, uint16_t numBanks) {
+  lfs_file_t file;
+  struct lfs_file_config fileconfig = {.buffer = _lfsFileBuffer};
+  char filenamebuffer[40] = "saves/";
+
+  strcpy(&filenamebuffer[strlen(filenamebuffer)], romInfo->name);
+  strcat(filenamebuffer, BANK_PROFILE_FILE_SUFFIX);
+
+  int lfs_err =
+      lfs_file_opencfg(&_lfs, &file, filenamebuffer, LFS_O_RDONLY, &fileconfig);
+
+  if (lfs_err != LFS_ERR_OK) {
+    return -1;
+  }
+
+  lfs_err = lfs_file_read(&_lfs, &file, selects, numBanks * sizeof(uint32_t));
+
   lfs_file_close(&_lfs, &file);
 
-  ws2812b_setRgb(0, 0x10, 0); // light up LED in green
+  if (lfs_err != (int)(numBanks * sizeof(uint32_t))) {
+    return -2;
+  }
+
+  return 0;
+}
+
+void storeBankProfileToFile(const struct RomInfo *romInfo, uint32_t *selects,
+                            uint16_t numBanks) {
+  lfs_file_t file;
+  struct lfs_file_config fileconfig = {.buffer = _lfsFileBuffer};
+  char filenamebuffer[40] = "saves/";
+  uint32_t previousSelects[32];
+
+  strcpy(&filenamebuffer[strlen(filenamebuffer)], romInfo->name);
+  strcat(filenamebuffer, BANK_PROFILE_FILE_SUFFIX);
+  printf("Saving bank profile to file %s\n", filenamebuffer);
+
+  int lfs_err = lfs_file_opencfg(&_lfs, &file, filenamebuffer,
+                                 LFS_O_RDWR | LFS_O_CREAT, &fileconfig);
+
+  if (lfs_err != LFS_ERR_OK) {
+    printf("Error opening file %d\n", lfs_err);
+    return;
+  }
+
+  // the previous sessions are weighted half, so the profile follows the game
+  for (uint16_t i = 0; i < numBanks; i += count_of(previousSelects)) {
+    const uint16_t n = MIN(count_of(previousSelects), numBanks - i);
+
+    lfs_err = lfs_file_read(&_lfs, &file, previousSelects, n * sizeof(uint32_t));
+    if (lfs_err != (int)(n * sizeof(uint32_t))) {
+      break;
+    }
+
+    for (uint16_t j = 0; j < n; j++) {
+      selects[i + j] += previousSelects[j] / 2;
+    }
+  }
+
+  lfs_file_rewind(&_lfs, &file);
+  lfs_err = lfs_file_write(&_lfs, &file, selects, numBanks * sizeof(uint32_t));
+  printf("wrote %d bytes\n", lfs_err);
+
+  lfs_file_close(&_lfs, &file);
 }
 
 int restoreRtcFromFile(const struct RomInfo *romInfo) {
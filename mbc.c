@@ -16,6 +16,8 @@
  */
 
 #include "mbc.h"
+#include "BusTrace.h"
+#include "Core1.h"
 #include "GameBoyHeader.h"
 #include "GbDma.h"
 #include "GbRtc.h"
@@ -33,10 +35,13 @@
 #include <hardware/pio.h>
 #include <hardware/regs/clocks.h>
 #include <hardware/structs/scb.h>
+#include <hardware/structs/systick.h>
 #include <hardware/sync.h>
 #include <hardware/timer.h>
 #include <pico/platform.h>
 
+#include <lfs_pico_hal.h>
+
 #include "gb-vblankhook/gbSaveGameVBlankHook.h"
 
 static bool _ramDirty = false;
@@ -47,6 +52,89 @@ static bool _hasRtc = false;
 static uint8_t _vBlankMode = 0;
 static uint8_t *_bankWithVBlankOverride = &memory[2 * GB_ROM_BANK_SIZE];
 
+/*
+ * Start of each save RAM bank, so a bank switch is only a table lookup and
+ * ram_base is up to date as fast as possible for the RAM DMA chains.
+ */
+static uint8_t *_ramBankPointers[GB_MAX_RAM_BANKS];
+
+/*
+ * Set of 4k address regions (one bit per addr >> 12) in which reads are passed
+ * on to the vblank hook and speed switch detection. Everything else is dropped
+ * in the MBC loops with a single test instead of calling into the snoopers.
+ */
+#define SNOOP_REGION(addr) (1U << ((addr) >> 12))
+#define SNOOP_ALL_REGIONS 0xFFFFU
+static uint16_t _snoopRegions = 0;
+static uint16_t _snoopRegionsIdle = 0;
+
+/*
+ * Until the vblank hook returns it only waits for one or two exact addresses,
+ * the vectors in the first 4k region are far too busy to pass all of them.
+ */
+static uint16_t _snoopAddrs[2] = {0x40, 0x40};
+
+static __force_inline void setSnoopAddrs(uint16_t first, uint16_t second) {
+  _snoopAddrs[0] = first;
+  _snoopAddrs[1] = second;
+}
+
+/*
+ * Number of times each ROM bank got selected while the game was running. It
+ * survives the reset needed to leave the game and is then added to the bank
+ * profile file, which decides the banks cached in SRAM on the next start.
+ */
+#define BANK_PROFILE_MAGIC 0x424B5052U
+
+struct BankProfile {
+  uint32_t magic;
+  uint16_t numBanks;
+  uint32_t selects[MAX_BANKS_PER_ROM];
+};
+
+static struct BankProfile __attribute__((section(".noinit."))) _bankProfile;
+
+#if MBC_PROFILING
+/*
+ * Statistics about the time needed to handle a write on the bus. They are kept
+ * in noinit RAM so they survive the reset which is needed to leave the game
+ * and can be printed on the next boot.
+ */
+#define MBC_PROFILE_MAGIC 0x4D424350U
+
+struct MbcProfile {
+  uint32_t magic;
+  uint32_t writes;
+  uint32_t maxCycles;
+  uint64_t totalCycles;
+  uint32_t reads;
+  uint32_t snoopedReads;
+};
+
+static struct MbcProfile __attribute__((section(".noinit."))) _mbcProfile;
+
+static inline void mbcProfileRecord(uint32_t start) {
+  // SysTick counts down and is 24 bits wide
+  const uint32_t cycles = (start - systick_hw->cvr) & 0x00FFFFFFU;
+
+  _mbcProfile.writes++;
+  _mbcProfile.totalCycles += cycles;
+  if (cycles > _mbcProfile.maxCycles) {
+    _mbcProfile.maxCycles = cycles;
+  }
+}
+
+#define MBC_PROFILE_START() const uint32_t profileStart = systick_hw->cvr
+#define MBC_PROFILE_END() mbcProfileRecord(profileStart)
+#define MBC_PROFILE_READ() _mbcProfile.reads++
+#define MBC_PROFILE_SNOOPED_READ() _mbcProfile.snoopedReads++
+#else
+#define MBC_PROFILE_START()
+#define MBC_PROFILE_END()
+#define MBC_PROFILE_READ()
+#define MBC_PROFILE_SNOOPED_READ()
+#endif
+
 void runNoMbcGame();
 void runMbc1Game();
 void runMbc2Game();
@@ -57,6 +145,84 @@ void detect_speed_change(uint16_t addr, uint16_t bank);
 void process_vblank_hook(uint16_t addr);
 void initialize_vblank_hook();
 void storeCurrentlyRunningSaveGame();
+void cacheRomBanks(uint8_t mbc);
+
+/*
+ * State of the emulated MBC registers. It is shared by all MBCs, each of them
+ * only uses the fields it needs.
+ */
+struct MbcState {
+  uint16_t romBank;
+  uint16_t romBanksMask;
+  uint8_t ramBank;
+  uint8_t ramBanksMask;
+  uint8_t romBankLow;
+  uint8_t romBankHigh;
+  bool ramEnabled;
+  bool hasSaveRam;
+  bool modeSelect;
+  bool rtcLatch;
+  bool romBankCached;
+};
+
+static struct MbcState _mbcState;
+
+typedef void (*MbcWriteHandler)(uint16_t addr, uint8_t data);
+
+/*
+ * Describes an MBC for runMbcEngine(). Writes are dispatched by the upper 4
+ * address bits, regions without a handler are ignored. The descriptors need
+ * to live in RAM as the flash is not accessible while a game is running.
+ *
+ * The dispatch is an indirect call, which costs a table load and a branch the
+ * compiler can not remove. MBC5 games switch banks all the time, so with
+ * mbc5Banking set the ROM and RAM bank selects (0x2000-0x5FFF) are handled
+ * inline by the engine before the table is consulted.
+ */
+struct MbcDescriptor {
+  MbcWriteHandler write[16];
+  bool snoopSpeedSwitch;
+  bool mbc5Banking;
+};
+
+/*
+ * Banks cached in SRAM hold a pointer instead of the SSI read command in
+ * g_loadedDirectAccessRomBanks. They are marked here, so the two can be told
+ * apart independent of the mode bits of the flash profile.
+ */
+static uint32_t _cachedRomBanks[MAX_BANKS_PER_ROM / 32];
+
+#define ROM_BANK_IS_CACHED(bank)                                               \
+  ((_cachedRomBanks[(bank) / 32] & (1U << ((bank) % 32))) != 0U)
+
+static __force_inline void setRomBank(uint16_t bank) {
+  const uint32_t base = g_loadedDirectAccessRomBanks[bank];
+  const bool cached = ROM_BANK_IS_CACHED(bank);
+
+  if (cached != _mbcState.romBankCached) {
+    _mbcState.romBankCached = cached;
+    if (cached) {
+      GbDma_RomHigherFromSram();
+    } else {
+      GbDma_RomHigherFromFlash();
+    }
+  }
+
+  _mbcState.romBank = bank;
+  rom_high_base_flash_direct = base;
+
+  _bankProfile.selects[bank]++;
+}
+
+static __force_inline void startGameBoy() {
+  pio_sm_set_enabled(pio0, SMC_GB_ROM_HIGH, true);
+
+  __compiler_memory_barrier();
+  setSsi8bit();
+  GbDma_StartDmaDirect();
+
+  gpio_put(PIN_GB_RESET, 0); // let the gameboy start (deassert reset line)
+}
 
 void loadGame(uint8_t mode) {
   uint8_t mbc = 0xFF;
@@ -106,14 +272,63 @@ void loadGame(uint8_t mode) {
 
   ws2812b_setRgb(0, 0, 0);
 
+  for (size_t i = 0; i < GB_MAX_RAM_BANKS; i++) {
+    _ramBankPointers[i] = &ram_memory[i * GB_RAM_BANK_SIZE];
+  }
+
   ram_base = ram_memory;
   GbDma_DisableSaveRam();
 
+  memset(g_saveRamDirtyPages, 0, sizeof(g_saveRamDirtyPages));
+
+  cacheRomBanks(mbc);
+
   memcpy(memory, g_loadedRomBanks[0], GB_ROM_BANK_SIZE);
   if (_vBlankMode) {
     initialize_vblank_hook();
   }
 
+  // The speed switch detection needs to see every read as the opcode sequence
+  // is reset by any other read. The vblank hook is only interested in the
+  // interrupt vector and the jump back to the game until it returns.
+  if (g_hardwareSupportsDoubleSpeed) {
+    _snoopRegionsIdle = SNOOP_ALL_REGIONS;
+  } else {
+    _snoopRegionsIdle = 0;
+  }
+  _snoopRegions = _snoopRegionsIdle;
+  setSnoopAddrs(0x40, 0x40);
+
+  // reads are only needed for the vblank hook and the speed switch detection
+  if (!_vBlankMode && !g_hardwareSupportsDoubleSpeed) {
+    loadWritesOnlyPio();
+  }
+
+  BusTrace_Start();
+
+#if MBC_PROFILING
+  memset(&_mbcProfile, 0, sizeof(_mbcProfile));
+  _mbcProfile.magic = MBC_PROFILE_MAGIC;
+
+  // let SysTick run freely on the processor clock
+  systick_hw->rvr = 0x00FFFFFFU;
+  systick_hw->cvr = 0;
+  systick_hw->csr =
+      M0PLUS_SYST_CSR_CLKSOURCE_BITS | M0PLUS_SYST_CSR_ENABLE_BITS;
+#endif
+
+  _mbcState = (struct MbcState){
+      .romBank = 1,
+      .romBanksMask = _numRomBanks - 1,
+      .ramBanksMask =
+          _numRamBanks ? (_numRamBanks - 1) & (GB_MAX_RAM_BANKS - 1) : 0,
+      .romBankLow = 1,
+      .hasSaveRam = (_numRamBanks > 0) || (mbc == 0x02),
+  };
+
+  // needs to be started while the flash is still accessible
+  Core1_Start(_hasRtc);
+
   switch (mbc) {
   case 0x00:
     runNoMbcGame();
@@ -136,8 +351,91 @@ void loadGame(uint8_t mode) {
   }
 }
 
+static void cacheRomBank(uint16_t bank, uint8_t *cache) {
+  memcpy(cache, g_loadedRomBanks[bank], GB_ROM_BANK_SIZE);
+  g_loadedDirectAccessRomBanks[bank] = (uint32_t)cache;
+  _cachedRomBanks[bank / 32] |= 1U << (bank % 32);
+}
+
+/*
+ * Copy switchable ROM banks into the part of the save RAM the game does not
+ * use. Reads of those banks are then served from SRAM instead of going through
+ * the SSI, which gives the higher ROM DMA chain a lot more timing margin.
+ * The banks selected most often in the previous sessions are cached first,
+ * the remaining space is filled up with the lowest banks.
+ */
+void cacheRomBanks(uint8_t mbc) {
+  // MBC2 keeps its 512 bytes of RAM at the end of the first bank
+  const uint8_t usedRamBanks =
+      ((mbc == 0x02) && (_numRamBanks == 0)) ? 1 : _numRamBanks;
+  uint8_t *cache = &ram_memory[usedRamBanks * GB_RAM_BANK_SIZE];
+  uint16_t cacheSlots =
+      ((GB_MAX_RAM_BANKS - usedRamBanks) * GB_RAM_BANK_SIZE) / GB_ROM_BANK_SIZE;
+  const uint16_t numBanks = (_numRomBanks < MAX_BANKS_PER_ROM)
+                                ? _numRomBanks
+                                : MAX_BANKS_PER_ROM;
+  uint16_t cachedBanks = 0;
+  uint16_t profiledBanks = 0;
+
+  if (cacheSlots > GB_ROM_CACHE_BANKS) {
+    cacheSlots = GB_ROM_CACHE_BANKS;
+  }
+
+  if ((cacheSlots > 0) &&
+      (restoreBankProfileFromFile(&g_loadedRomInfo, _bankProfile.selects,
+                                  numBanks) == 0)) {
+    while (cachedBanks < cacheSlots) {
+      uint16_t hottest = 0;
+      uint32_t hottestSelects = 0;
+
+      for (uint16_t bank = 1; bank < numBanks; bank++) {
+        if ((_bankProfile.selects[bank] > hottestSelects) &&
+            !ROM_BANK_IS_CACHED(bank)) {
+          hottest = bank;
+          hottestSelects = _bankProfile.selects[bank];
+        }
+      }
+
+      if (hottest == 0) {
+        break;
+      }
+
+      cacheRomBank(hottest, &cache[cachedBanks * GB_ROM_BANK_SIZE]);
+      cachedBanks++;
+    }
+    profiledBanks = cachedBanks;
+  }
+
+  for (uint16_t bank = 1; (bank < numBanks) && (cachedBanks < cacheSlots);
+       bank++) {
+    if (!ROM_BANK_IS_CACHED(bank)) {
+      cacheRomBank(bank, &cache[cachedBanks * GB_ROM_BANK_SIZE]);
+      cachedBanks++;
+    }
+  }
+
+  printf("cached ROM banks: %d (%d from profile)\n", cachedBanks,
+         profiledBanks);
+
+  // start counting the bank selects of this session
+  memset(_bankProfile.selects, 0, sizeof(_bankProfile.selects));
+  _bankProfile.numBanks = numBanks;
+  _bankProfile.magic = (mbc != 0x00) ? BANK_PROFILE_MAGIC : 0;
+}
+
+void storeBankProfile() {
+  if (_bankProfile.magic != BANK_PROFILE_MAGIC) {
+    return;
+  }
+
+  storeBankProfileToFile(&g_loadedRomInfo, _bankProfile.selects,
+                         _bankProfile.numBanks);
+
+  _bankProfile.magic = 0;
+}
+
 void __no_inline_not_in_flash_func(runNoMbcGame)() {
-  rom_high_base_flash_direct = g_loadedDirectAccessRomBanks[1];
+  setRomBank(1);
 
   // disable RAM access state machines, they are not needed without any MBC
   pio_set_sm_mask_enabled(pio1,
@@ -164,13 +462,7 @@ void __no_inline_not_in_flash_func(runNoMbcGame)() {
 
   printf("No MBC game loaded\n");
 
-  pio_sm_set_enabled(pio0, SMC_GB_ROM_HIGH, true);
-
-  __compiler_memory_barrier();
-  setSsi8bit();
-  GbDma_StartDmaDirect();
-
-  gpio_put(PIN_GB_RESET, 0); // let the gameboy start (deassert reset line)
+  startGameBoy();
 
   // uint save = scb_hw->scr;
   // // Enable deep sleep at the proc
@@ -186,28 +478,8 @@ void __no_inline_not_in_flash_func(runNoMbcGame)() {
   }
 }
 
-void __no_inline_not_in_flash_func(runMbc1Game)() {
-  uint8_t rom_bank = 1;
-  uint8_t rom_bank_new = 1;
-  uint8_t rom_bank_high = 0;
-  uint8_t rom_bank_low = 1;
-  uint8_t ram_bank = 0;
-  bool ram_enabled = 0;
-  bool mode_select = 0;
-  uint16_t rom_banks_mask = _numRomBanks - 1;
-
-  rom_high_base_flash_direct = g_loadedDirectAccessRomBanks[1];
-
-  printf("MBC1 game loaded\n");
-  printf("initial bank %d a %p\n", rom_bank, g_loadedRomBanks[1]);
-
-  pio_sm_set_enabled(pio0, SMC_GB_ROM_HIGH, true);
-
-  __compiler_memory_barrier();
-  setSsi8bit();
-  GbDma_StartDmaDirect();
-
-  gpio_put(PIN_GB_RESET, 0); // let the gameboy start (deassert reset line)
+static __force_inline void runMbcEngine(const struct MbcDescriptor *mbc) {
+  startGameBoy();
 
   while (1) {
     if (!pio_sm_is_rx_fifo_empty(pio1, SMC_GB_MAIN)) {
@@ -217,81 +489,195 @@ void __no_inline_not_in_flash_func(runMbc1Game)() {
 
       if (write) {
         uint8_t data = pio_sm_get_blocking(pio1, SMC_GB_MAIN) & 0xFF;
-
-        switch (addr & 0xE000) {
-        case 0x0000:
-          ram_enabled = ((data & 0x0F) == 0x0A);
-          if (ram_enabled) {
-            GbDma_EnableSaveRam();
-          } else {
-            GbDma_DisableSaveRam();
-          }
-          break;
-
-        case 0x2000:
-          rom_bank_low = (data & 0x1F);
-          if ((rom_bank_low & 0x1F) == 0x00)
-            rom_bank_low++;
-          break;
-
-        case 0x4000:
-          if (mode_select) {
-            ram_bank = data & 0x03;
-            ram_base = &ram_memory[ram_bank * GB_RAM_BANK_SIZE];
+        MBC_PROFILE_START();
+
+        /*
+         * ROM bank switches are by far the most frequent writes. They are
+         * handled first, so the new bank is active before anything else
+         * (tracing, the dispatch below) is done.
+         */
+        if (mbc->mbc5Banking && ((addr & 0xE000) == 0x2000)) {
+          if (addr & 0x1000) {
+            setRomBank(((_mbcState.romBank & 0x00FF) | ((data << 8) & 0x0100)) &
+                       _mbcState.romBanksMask);
           } else {
-            rom_bank_high = data & 0x03;
-          }
-          break;
-
-        case 0x6000:
-          mode_select = (data & 1);
-          break;
-        case 0xA000: // write to RAM
-          if (!_ramDirty && ram_enabled) {
-            ws2812b_setRgb(0x10, 0, 0); // switch on LED to red
-            _ramDirty = true;
+            setRomBank(((_mbcState.romBank & 0x0100) | data) &
+                       _mbcState.romBanksMask);
           }
-          break;
-        default:
 
-          break;
+          BUS_TRACE_WRITE(addr, data);
+          MBC_PROFILE_END();
+          continue;
         }
 
-        if (mode_select == 0) {
-          rom_bank_new = (rom_bank_high << 5) | rom_bank_low;
-        } else {
-          rom_bank_new = rom_bank_low;
+        if (mbc->mbc5Banking && ((addr & 0xE000) == 0x4000)) {
+          ram_base = _ramBankPointers[data & _mbcState.ramBanksMask];
+
+          BUS_TRACE_WRITE(addr, data);
+          MBC_PROFILE_END();
+          continue;
         }
-        rom_bank_new = rom_bank_new & rom_banks_mask;
 
-        if (rom_bank != rom_bank_new) {
-          rom_bank = rom_bank_new;
-          rom_high_base_flash_direct = g_loadedDirectAccessRomBanks[rom_bank];
+        const MbcWriteHandler handler = mbc->write[addr >> 12];
+        if (handler) {
+          handler(addr, data);
         }
+
+        BUS_TRACE_WRITE(addr, data);
+        MBC_PROFILE_END();
       } else { // read
+        MBC_PROFILE_READ();
+        if (!(_snoopRegions & SNOOP_REGION(addr)) && (addr != _snoopAddrs[0]) &&
+            (addr != _snoopAddrs[1])) {
+          continue;
+        }
+
+        MBC_PROFILE_SNOOPED_READ();
         if (_vBlankMode) {
           process_vblank_hook(addr);
         }
+        if (mbc->snoopSpeedSwitch && g_hardwareSupportsDoubleSpeed) {
+          detect_speed_change(addr, _mbcState.romBank);
+        }
       }
     }
   }
 }
 
-void __no_inline_not_in_flash_func(runMbc2Game)() {
-  uint8_t rom_bank = 1;
-  uint16_t rom_banks_mask = _numRomBanks - 1;
-  bool ram_enabled = 0;
+/*
+ * The RAM DMA chains store the byte without the CPU, but every write is also
+ * seen here. Mark the page it went to, ram_base points to the selected bank.
+ */
+static __force_inline void markSaveRamDirty(uint16_t addr) {
+  const uint32_t page =
+      ((uint32_t)(ram_base - ram_memory) + (addr & (GB_RAM_BANK_SIZE - 1))) /
+      SAVE_RAM_PAGE_SIZE;
+  g_saveRamDirtyPages[page / 32] |= 1U << (page % 32);
+}
 
-  rom_high_base_flash_direct = g_loadedDirectAccessRomBanks[1];
+static void __no_inline_not_in_flash_func(writeRamEnable)(uint16_t addr,
+                                                          uint8_t data) {
+  /*
+   * Without save RAM the cached ROM banks start at ram_base. Games without
+   * RAM often enable it anyway, their writes must not reach the cache.
+   */
+  _mbcState.ramEnabled = _mbcState.hasSaveRam && ((data & 0x0F) == 0x0A);
+  if (_mbcState.ramEnabled) {
+    GbDma_EnableSaveRam();
+  } else {
+    GbDma_DisableSaveRam();
+  }
+}
 
-  printf("MBC2 game loaded\n");
-  printf("initial bank %d a %p\n", rom_bank, g_loadedRomBanks[1]);
+static void __no_inline_not_in_flash_func(writeSaveRam)(uint16_t addr,
+                                                        uint8_t data) {
+  if (_mbcState.ramEnabled) {
+    markSaveRamDirty(addr);
+    if (!_ramDirty) {
+      Core1_SetRgb(0x10, 0, 0); // switch on LED to red
+      _ramDirty = true;
+    }
+  }
+}
 
-  pio_sm_set_enabled(pio0, SMC_GB_ROM_HIGH, true);
+static __force_inline void mbc1UpdateRomBank() {
+  uint8_t bank = _mbcState.romBankLow;
+  if (_mbcState.modeSelect == 0) {
+    bank |= _mbcState.romBankHigh << 5;
+  }
+  setRomBank(bank & _mbcState.romBanksMask);
+}
 
-  __compiler_memory_barrier();
-  setSsi8bit();
-  GbDma_StartDmaDirect();
+static void __no_inline_not_in_flash_func(mbc1WriteRomBank)(uint16_t addr,
+                                                            uint8_t data) {
+  _mbcState.romBankLow = (data & 0x1F);
+  if (_mbcState.romBankLow == 0x00) {
+    _mbcState.romBankLow++;
+  }
+  mbc1UpdateRomBank();
+}
+
+static void __no_inline_not_in_flash_func(mbc1WriteBankHigh)(uint16_t addr,
+                                                             uint8_t data) {
+  if (_mbcState.modeSelect) {
+    _mbcState.ramBank = data & 0x03 & _mbcState.ramBanksMask;
+    ram_base = _ramBankPointers[_mbcState.ramBank];
+  } else {
+    _mbcState.romBankHigh = data & 0x03;
+  }
+  mbc1UpdateRomBank();
+}
+
+static void __no_inline_not_in_flash_func(mbc1WriteModeSelect)(uint16_t addr,
+                                                               uint8_t data) {
+  _mbcState.modeSelect = (data & 1);
+  mbc1UpdateRomBank();
+}
+
+static const struct MbcDescriptor __not_in_flash("mbc") _mbc1 = {
+    .write =
+        {
+            [0x0] = writeRamEnable,
+            [0x1] = writeRamEnable,
+            [0x2] = mbc1WriteRomBank,
+            [0x3] = mbc1WriteRomBank,
+            [0x4] = mbc1WriteBankHigh,
+            [0x5] = mbc1WriteBankHigh,
+            [0x6] = mbc1WriteModeSelect,
+            [0x7] = mbc1WriteModeSelect,
+            [0xA] = writeSaveRam,
+            [0xB] = writeSaveRam,
+        },
+    .snoopSpeedSwitch = false,
+    .mbc5Banking = false,
+};
+
+void __no_inline_not_in_flash_func(runMbc1Game)() {
+  setRomBank(1);
+
+  printf("MBC1 game loaded\n");
+  printf("initial bank %d a %p\n", _mbcState.romBank, g_loadedRomBanks[1]);
+
+  runMbcEngine(&_mbc1);
+}
+
+static void __no_inline_not_in_flash_func(mbc2WriteRegister)(uint16_t addr,
+                                                             uint8_t data) {
+  if (addr & 0x100) {
+    uint16_t bank = (data & _mbcState.romBanksMask);
+    if (bank == 0x00) {
+      bank++;
+    }
+    setRomBank(bank);
+  } else {
+    _mbcState.ramEnabled = (data == 0xA);
+    if (_mbcState.ramEnabled) {
+      GbDma_EnableSaveRam();
+    } else {
+      GbDma_DisableSaveRam();
+    }
+  }
+}
+
+static const struct MbcDescriptor __not_in_flash("mbc") _mbc2 = {
+    .write =
+        {
+            [0x0] = mbc2WriteRegister,
+            [0x1] = mbc2WriteRegister,
+            [0x2] = mbc2WriteRegister,
+            [0x3] = mbc2WriteRegister,
+            [0xA] = writeSaveRam,
+            [0xB] = writeSaveRam,
+        },
+    .snoopSpeedSwitch = false,
+    .mbc5Banking = false,
+};
+
+void __no_inline_not_in_flash_func(runMbc2Game)() {
+  setRomBank(1);
+
+  printf("MBC2 game loaded\n");
+  printf("initial bank %d a %p\n", _mbcState.romBank, g_loadedRomBanks[1]);
 
   /*
    * Set base addr so that the higher 4 addr bits to be set. This trick causes
@@ -300,64 +686,101 @@ void __no_inline_not_in_flash_func(runMbc2Game)() {
    */
   ram_base = &ram_memory[GB_RAM_BANK_SIZE - GB_MBC2_RAM_SIZE];
 
-  gpio_put(PIN_GB_RESET, 0); // let the gameboy start (deassert reset line)
+  runMbcEngine(&_mbc2);
+}
 
-  while (1) {
-    if (!pio_sm_is_rx_fifo_empty(pio1, SMC_GB_MAIN)) {
-      uint32_t rdAndAddr = pio_sm_get_blocking(pio1, SMC_GB_MAIN);
-      bool write = rdAndAddr & 0x00000001;
-      uint16_t addr = (rdAndAddr >> 1) & 0xFFFF;
+static void __no_inline_not_in_flash_func(mbc3WriteRamEnable)(uint16_t addr,
+                                                              uint8_t data) {
+  _mbcState.ramEnabled = ((data & 0x0F) == 0x0A);
+  if (_mbcState.ramEnabled) {
+    if (_mbcState.ramBank & 0x08) {
+      GbDma_EnableRtc();
+    } else if (_mbcState.hasSaveRam) {
+      GbDma_EnableSaveRam();
+    } else {
+      GbDma_DisableSaveRam(); // the RTC may have been mapped before
+    }
+  } else {
+    GbDma_DisableSaveRam();
+  }
+}
 
-      if (write) {
-        uint8_t data = pio_sm_get_blocking(pio1, SMC_GB_MAIN) & 0xFF;
+static void __no_inline_not_in_flash_func(mbc3WriteRomBank)(uint16_t addr,
+                                                            uint8_t data) {
+  uint16_t bank = (data & _mbcState.romBanksMask);
+  if (bank == 0x00) {
+    bank++;
+  }
+  setRomBank(bank);
+}
 
-        switch (addr & 0xE000) {
-        case 0x0000:
-        case 0x2000:
-          if (addr & 0x100) {
-            rom_bank = (data & rom_banks_mask);
-            if (rom_bank == 0x00) {
-              rom_bank++;
-            }
-            rom_high_base_flash_direct = g_loadedDirectAccessRomBanks[rom_bank];
-          } else {
-            ram_enabled = (data == 0xA);
-            if (ram_enabled) {
-              GbDma_EnableSaveRam();
-            } else {
-              GbDma_DisableSaveRam();
-            }
-          }
-          break;
+static void __no_inline_not_in_flash_func(mbc3WriteRamBank)(uint16_t addr,
+                                                            uint8_t data) {
+  _mbcState.ramBank = data;
+  if (data & 0x08) {
+    GbRtc_ActivateRegister(data & 0x07);
+    if (_mbcState.ramEnabled) {
+      GbDma_EnableRtc();
+    }
+  } else {
+    ram_base = _ramBankPointers[data & 0x03 & _mbcState.ramBanksMask];
+    if (_mbcState.ramEnabled) {
+      if (_mbcState.hasSaveRam) {
+        GbDma_EnableSaveRam();
+      } else {
+        GbDma_DisableSaveRam();
+      }
+    }
+  }
+}
 
-        case 0xA000: // write to RAM
-          if (!_ramDirty && ram_enabled) {
-            ws2812b_setRgb(0x10, 0, 0); // switch on LED to red
-            _ramDirty = true;
-          }
-          break;
-        default:
+static void __no_inline_not_in_flash_func(mbc3WriteRtcLatch)(uint16_t addr,
+                                                             uint8_t data) {
+  if (data) {
+    if (!_mbcState.rtcLatch) {
+      _mbcState.rtcLatch = true;
+      Core1_RtcLatch();
+    }
+  } else {
+    _mbcState.rtcLatch = false;
+  }
+}
 
-          break;
-        }
-      } else { // read
-        if (_vBlankMode) {
-          process_vblank_hook(addr);
-        }
+static void __no_inline_not_in_flash_func(mbc3WriteRam)(uint16_t addr,
+                                                        uint8_t data) {
+  if (_mbcState.ramEnabled) {
+    if (_mbcState.ramBank & 0x08) {
+      Core1_RtcWriteRegister(_mbcState.ramBank & 0x07, data);
+    } else if (_mbcState.hasSaveRam) {
+      markSaveRamDirty(addr);
+      if (!_ramDirty) {
+        Core1_SetRgb(0x10, 0, 0); // switch on LED to red
+        _ramDirty = true;
       }
     }
   }
 }
 
-void __no_inline_not_in_flash_func(runMbc3Game)() {
-  uint8_t rom_bank = 1;
-  uint8_t ram_bank = 0;
-  bool ram_enabled = 0;
-  uint16_t rom_banks_mask = _numRomBanks - 1;
-  uint64_t now, lastSecond = time_us_64();
-  bool rtcLatch = false;
+static const struct MbcDescriptor __not_in_flash("mbc") _mbc3 = {
+    .write =
+        {
+            [0x0] = mbc3WriteRamEnable,
+            [0x1] = mbc3WriteRamEnable,
+            [0x2] = mbc3WriteRomBank,
+            [0x3] = mbc3WriteRomBank,
+            [0x4] = mbc3WriteRamBank,
+            [0x5] = mbc3WriteRamBank,
+            [0x6] = mbc3WriteRtcLatch,
+            [0x7] = mbc3WriteRtcLatch,
+            [0xA] = mbc3WriteRam,
+            [0xB] = mbc3WriteRam,
+        },
+    .snoopSpeedSwitch = true,
+    .mbc5Banking = false,
+};
 
-  rom_high_base_flash_direct = g_loadedDirectAccessRomBanks[1];
+void __no_inline_not_in_flash_func(runMbc3Game)() {
+  setRomBank(1);
 
   if (g_loadedRomInfo.speedSwitchBank <= _numRomBanks) {
     _speedSwitchBank = g_loadedRomInfo.speedSwitchBank;
@@ -370,110 +793,26 @@ void __no_inline_not_in_flash_func(runMbc3Game)() {
 
   printf("MBC3 game loaded\n");
   printf("has RTC: %d\n", _hasRtc);
-  printf("initial bank %d a %p\n", rom_bank, g_loadedRomBanks[1]);
+  printf("initial bank %d a %p\n", _mbcState.romBank, g_loadedRomBanks[1]);
   printf("speedSwitchBank %d\n", _speedSwitchBank);
 
-  pio_sm_set_enabled(pio0, SMC_GB_ROM_HIGH, true);
-
-  __compiler_memory_barrier();
-  setSsi8bit();
-  GbDma_StartDmaDirect();
-
-  gpio_put(PIN_GB_RESET, 0); // let the gameboy start (deassert reset line)
-
-  while (1) {
-    if (!pio_sm_is_rx_fifo_empty(pio1, SMC_GB_MAIN)) {
-      uint32_t rdAndAddr = pio_sm_get_blocking(pio1, SMC_GB_MAIN);
-      bool write = rdAndAddr & 0x00000001;
-      uint16_t addr = (rdAndAddr >> 1) & 0xFFFF;
-
-      if (write) {
-        uint8_t data = pio_sm_get_blocking(pio1, SMC_GB_MAIN) & 0xFF;
-
-        switch (addr & 0xE000) {
-        case 0x0000:
-          ram_enabled = ((data & 0x0F) == 0x0A);
-          if (ram_enabled) {
-            if (ram_bank & 0x08) {
-              GbDma_EnableRtc();
-            } else {
-              GbDma_EnableSaveRam();
-            }
-          } else {
-            GbDma_DisableSaveRam();
-          }
-          break;
-
-        case 0x2000:
-          rom_bank = (data & rom_banks_mask);
-          if (rom_bank == 0x00) {
-            rom_bank++;
-          }
-          rom_high_base_flash_direct = g_loadedDirectAccessRomBanks[rom_bank];
-          break;
-
-        case 0x4000:
-          ram_bank = data;
-          if (ram_bank & 0x08) {
-            GbRtc_ActivateRegister(ram_bank & 0x07);
-            if (ram_enabled) {
-              GbDma_EnableRtc();
-            }
-          } else {
-            ram_base = &ram_memory[(ram_bank & 0x03) * GB_RAM_BANK_SIZE];
-            if (ram_enabled) {
-              GbDma_EnableSaveRam();
-            }
-          }
-
-          break;
-
-        case 0x6000:
-          if (data) {
-            if (!rtcLatch) {
-              rtcLatch = true;
-              memcpy((void *)&g_rtcLatched, (void *)&g_rtcReal,
-                     sizeof(struct GbRtc));
-            }
-          } else {
-            rtcLatch = false;
-          }
-          break;
-        case 0xA000: // write to RAM
-          if (ram_enabled) {
-            if (ram_bank & 0x08) {
-              GbRtc_WriteRegister(data);
-            } else if (!_ramDirty) {
-              ws2812b_setRgb(0x10, 0, 0); // switch on LED to red
-              _ramDirty = true;
-            }
-          }
-          break;
-        default:
-
-          break;
-        }
-      } else { // read
-        if (_vBlankMode) {
-          process_vblank_hook(addr);
-        }
-        if (g_hardwareSupportsDoubleSpeed) {
-          detect_speed_change(addr, rom_bank);
-        }
-      }
-    }
-
-    GbRtc_PerformRtcTick();
-  } // endless loop
+  runMbcEngine(&_mbc3);
 }
 
-void __no_inline_not_in_flash_func(runMbc5Game)() {
-  uint16_t rom_bank = 1;
-  uint8_t ram_bank = 0;
-  bool ram_enabled = 0;
-  const uint16_t rom_banks_mask = _numRomBanks - 1;
-  const uint8_t ram_banks_mask = _numRamBanks - 1;
+static const struct MbcDescriptor __not_in_flash("mbc") _mbc5 = {
+    .write =
+        {
+            [0x0] = writeRamEnable,
+            [0x1] = writeRamEnable,
+            // 0x2000-0x5FFF are handled inline by runMbcEngine()
+            [0xA] = writeSaveRam,
+            [0xB] = writeSaveRam,
+        },
+    .snoopSpeedSwitch = true,
+    .mbc5Banking = true,
+};
 
+void __no_inline_not_in_flash_func(runMbc5Game)() {
   if (g_loadedRomInfo.speedSwitchBank <= _numRomBanks) {
     _speedSwitchBank = g_loadedRomInfo.speedSwitchBank;
   }
@@ -481,79 +820,13 @@ void __no_inline_not_in_flash_func(runMbc5Game)() {
   memcpy(&memory[GB_ROM_BANK_SIZE], g_loadedRomBanks[_speedSwitchBank],
          GB_ROM_BANK_SIZE);
 
-  rom_high_base_flash_direct = g_loadedDirectAccessRomBanks[1];
+  setRomBank(1);
 
   printf("MBC5 game loaded\n");
-  printf("initial bank %d a %p\n", rom_bank, g_loadedRomBanks[1]);
+  printf("initial bank %d a %p\n", _mbcState.romBank, g_loadedRomBanks[1]);
   printf("speedSwitchBank %d\n", _speedSwitchBank);
 
-  pio_sm_set_enabled(pio0, SMC_GB_ROM_HIGH, true);
-
-  __compiler_memory_barrier();
-  setSsi8bit();
-  GbDma_StartDmaDirect();
-
-  gpio_put(PIN_GB_RESET, 0); // let the gameboy start (deassert reset line)
-
-  while (1) {
-    if (!pio_sm_is_rx_fifo_empty(pio1, SMC_GB_MAIN)) {
-      uint32_t rdAndAddr = pio_sm_get_blocking(pio1, SMC_GB_MAIN);
-      bool write = rdAndAddr & 0x00000001;
-      uint16_t addr = (rdAndAddr >> 1) & 0xFFFF;
-
-      if (write) {
-        uint8_t data = pio_sm_get_blocking(pio1, SMC_GB_MAIN) & 0xFF;
-
-        switch (addr & 0xF000) {
-        case 0x0000:
-        case 0x1000:
-          ram_enabled = ((data & 0x0F) == 0x0A);
-          if (ram_enabled) {
-            GbDma_EnableSaveRam();
-          } else {
-            GbDma_DisableSaveRam();
-          }
-          break;
-
-        case 0x2000:
-          rom_bank = (rom_bank & 0x0100) | data;
-          rom_bank = rom_bank & rom_banks_mask;
-          rom_high_base_flash_direct = g_loadedDirectAccessRomBanks[rom_bank];
-          break;
-
-        case 0x3000:
-          rom_bank = (rom_bank & 0x00FF) | ((data << 8) & 0x0100);
-          rom_bank = rom_bank & rom_banks_mask;
-          rom_high_base_flash_direct = g_loadedDirectAccessRomBanks[rom_bank];
-          break;
-        case 0x4000:
-          ram_bank = data & ram_banks_mask;
-          ram_base = &ram_memory[ram_bank * GB_RAM_BANK_SIZE];
-          break;
-
-        case 0x6000:
-
-          break;
-        case 0xA000: // write to RAM
-          if (!_ramDirty && ram_enabled) {
-            ws2812b_setRgb(0x10, 0, 0); // switch on LED to red
-            _ramDirty = true;
-          }
-          break;
-        default:
-
-          break;
-        }
-      } else { // read
-        if (_vBlankMode) {
-          process_vblank_hook(addr);
-        }
-        if (g_hardwareSupportsDoubleSpeed) {
-          detect_speed_change(addr, rom_bank);
-        }
-      }
-    }
-  }
+  runMbcEngine(&_mbc5);
 }
 
 enum eLDH_STATE {
@@ -680,25 +953,31 @@ void __no_inline_not_in_flash_func(process_vblank_hook)(uint16_t addr) {
     if (addr == 0x40) {
       rom_low_base = memory_vblank_hook_bank;
       _vblankHookState = VBLANK_HOOK_INTERRUPT;
+      setSnoopAddrs(0x50, 0x50);
     }
   } else if (_vblankHookState == VBLANK_HOOK_INTERRUPT) {
     if (addr == 0x50) {
       rom_low_base = memory_vblank_hook_bank2;
       _vblankHookState = VBLANK_HOOK_PROCESSING;
+      setSnoopAddrs(0x100, 0x40);
     }
   } else if (_vblankHookState == VBLANK_HOOK_PROCESSING) {
     if (addr == 0x100) {
       _vblankHookState = VBLANK_HOOK_SAVE_TRIGGERED;
+      setSnoopAddrs(0x40, 0x40);
 
       storeCurrentlyRunningSaveGame();
       memory_vblank_hook_bank2[0x1FF] = 0xaa;
     } else if (addr == 0x40) {
       rom_low_base = memory;
       _vblankHookState = VBLANK_HOOK_RETURNED;
+      _snoopRegions = SNOOP_ALL_REGIONS;
     }
   } else if (_vblankHookState == VBLANK_HOOK_RETURNED) {
     if ((addr & 0xFFF8) != 0x40) {
       _vblankHookState = VBLANK_HOOK_IDLE;
+      _snoopRegions = _snoopRegionsIdle;
+      setSnoopAddrs(0x40, 0x40);
       rom_low_base = _bankWithVBlankOverride;
       memory_vblank_hook_bank2[0x1FF] = 0;
     }
@@ -706,11 +985,37 @@ void __no_inline_not_in_flash_func(process_vblank_hook)(uint16_t addr) {
     if (addr == 0x40) {
       rom_low_base = memory;
       _vblankHookState = VBLANK_HOOK_RETURNED;
+      _snoopRegions = SNOOP_ALL_REGIONS;
     }
   } else {
   }
 }
 
+void printMbcProfile() {
+#if MBC_PROFILING
+  if ((_mbcProfile.magic != MBC_PROFILE_MAGIC) || (_mbcProfile.writes == 0)) {
+    return;
+  }
+
+  const uint32_t sysClkMhz = clock_get_hz(clk_sys) / 1000000U;
+  const uint32_t avgNs = (uint32_t)((_mbcProfile.totalCycles * 1000U) /
+                                    _mbcProfile.writes / sysClkMhz);
+  const uint32_t maxNs = (_mbcProfile.maxCycles * 1000U) / sysClkMhz;
+
+  printf("MBC profile: %u writes, avg %u ns, max %u ns\n",
+         _mbcProfile.writes, avgNs, maxNs);
+  printf("MBC profile: %u of %u reads passed to the snoopers\n",
+         _mbcProfile.snoopedReads, _mbcProfile.reads);
+
+  if (maxNs > MBC_PROFILING_BUDGET_NS) {
+    printf("MBC write handling exceeds budget of %u ns\n",
+           MBC_PROFILING_BUDGET_NS);
+  }
+
+  _mbcProfile.magic = 0;
+#endif
+}
+
 void initialize_vblank_hook() {
   memcpy(memory_vblank_hook_bank, GB_VBLANK_HOOK, GB_VBLANK_HOOK_SIZE);
 
@@ -736,17 +1041,33 @@ void __no_inline_not_in_flash_func(storeCurrentlyRunningSaveGame)() {
   setSsi32bit();
   __compiler_memory_barrier();
 
+#if MBC_PROFILING
+  pico_hal_reset_stats();
+  const uint32_t start = time_us_32();
+#endif
+
   storeSaveRamToFile(&g_loadedRomInfo);
   if (_hasRtc) {
     storeRtcToFile(&g_loadedRomInfo);
   }
 
-  ws2812b_setRgb(0, 0x10, 0);
+#if MBC_PROFILING
+  /*
+   * printf() runs from flash, so it can't be moved after the SSI switched
+   * back. The game stays frozen while this is printed, which is only
+   * acceptable in profiling builds.
+   */
+  printf("Game was frozen for %u us\n", time_us_32() - start);
+  pico_hal_print_stats("save");
+#endif
+
+  Core1_SetRgb(0, 0x10, 0);
 
   setSsi8bit();
   __compiler_memory_barrier();
 
   _ramDirty = false;
+  memset(g_saveRamDirtyPages, 0, sizeof(g_saveRamDirtyPages));
 
   pio_set_sm_mask_enabled(pio1, (1 << SMC_GB_MAIN), true);
 }
@@ -4,5 +4,7 @@
 #include <stdint.h>
 
 void loadGame(uint8_t mode);
+void printMbcProfile();
+void storeBankProfile();
 
 #endif /* FAAE3125_340E_4959_9C48_AA11DF5F4BE0 */
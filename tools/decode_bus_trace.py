@@ -0,0 +1,144 @@
+#!/usr/bin/env python3
+# RP2040 GameBoy cartridge
+# Copyright (C) 2024 Sebastian Quilitz
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+"""Download and decode the bus trace of a firmware built with GB_BUS_TRACE.
+
+The trace holds the writes of the last game that ran, see BusTrace.h for the
+format. Reset the cartridge into the menu before downloading it.
+
+  decode_bus_trace.py fetch trace.bin   download the trace over USB (pyusb)
+  decode_bus_trace.py decode trace.bin  print the writes and some statistics
+"""
+
+import argparse
+import collections
+import struct
+import sys
+
+USB_VID = 0x2E8A
+USB_PID = 0x107F
+USB_INTERFACE = 0
+USB_EP_OUT = 0x02
+USB_EP_IN = 0x82
+
+COMMAND_BUS_TRACE = 12
+ENTRY = struct.Struct("<IHBB")
+FLAG_WRITE = 0x01
+
+REGIONS = [
+    (0x0000, 0x1FFF, "RAM enable"),
+    (0x2000, 0x3FFF, "ROM bank"),
+    (0x4000, 0x5FFF, "RAM bank / RTC select"),
+    (0x6000, 0x7FFF, "mode / RTC latch"),
+    (0xA000, 0xBFFF, "save RAM"),
+]
+
+
+def region_name(addr):
+    for start, end, name in REGIONS:
+        if start <= addr <= end:
+            return name
+    return "other"
+
+
+def fetch(path):
+    import usb.core
+
+    dev = usb.core.find(idVendor=USB_VID, idProduct=USB_PID)
+    if dev is None:
+        sys.exit("cartridge not found")
+
+    dev.set_configuration()
+    # the firmware only answers after the WebSerial connect request
+    dev.ctrl_transfer(0x21, 0x22, 1, USB_INTERFACE)
+
+    data = bytearray()
+    first = 0
+    while True:
+        dev.write(USB_EP_OUT, bytes([COMMAND_BUS_TRACE]) + struct.pack(">I", first))
+        resp = bytes(dev.read(USB_EP_IN, 64))
+        if resp[0] != COMMAND_BUS_TRACE:
+            sys.exit("no bus trace available")
+        total, count = struct.unpack(">IB", resp[1:6])
+        data += resp[6 : 6 + count * ENTRY.size]
+        first += count
+        if count == 0 or first >= total:
+            break
+
+    dev.ctrl_transfer(0x21, 0x22, 0, USB_INTERFACE)
+
+    with open(path, "wb") as f:
+        f.write(data)
+    print("stored %d writes in %s" % (first, path))
+
+
+def decode(path, quiet):
+    with open(path, "rb") as f:
+        data = f.read()
+
+    entries = [ENTRY.unpack_from(data, i) for i in range(0, len(data) - ENTRY.size + 1, ENTRY.size)]
+    if not entries:
+        print("empty trace")
+        return
+
+    per_region = collections.Counter()
+    rom_banks = collections.Counter()
+    min_interval = None
+    last_ts = entries[0][0]
+
+    for ts, addr, value, flags in entries:
+        interval = (ts - last_ts) & 0xFFFFFFFF
+        last_ts = ts
+        if interval and (min_interval is None or interval < min_interval):
+            min_interval = interval
+
+        region = region_name(addr)
+        per_region[region] += 1
+        if region == "ROM bank":
+            rom_banks[value] += 1
+
+        if not quiet:
+            kind = "W" if flags & FLAG_WRITE else "R"
+            print("%10u us +%8u %s %04X %02X  %s" % (ts, interval, kind, addr, value, region))
+
+    duration = (entries[-1][0] - entries[0][0]) & 0xFFFFFFFF
+    print()
+    print("%d writes in %.3f s" % (len(entries), duration / 1e6))
+    if min_interval is not None:
+        print("shortest time between two writes: %u us" % min_interval)
+    for name, count in per_region.most_common():
+        print("  %-22s %8d" % (name, count))
+    print("most selected ROM bank register values:")
+    for bank, count in rom_banks.most_common(16):
+        print("  0x%02X %8d" % (bank, count))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("command", choices=["fetch", "decode"])
+    parser.add_argument("file")
+    parser.add_argument("-q", "--quiet", action="store_true", help="only print the statistics")
+    args = parser.parse_args()
+
+    if args.command == "fetch":
+        fetch(args.file)
+    else:
+        decode(args.file, args.quiet)
+
+
+if __name__ == "__main__":
+    main()
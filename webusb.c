@@ -21,6 +21,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <tusb.h>
+#include <hardware/timer.h>
 
 #include <pico/stdio.h>
 #include <pico/stdio_uart.h>
@@ -28,6 +29,7 @@
 #include <git_commit.h>
 
 #include "BuildVersion.h"
+#include "BusTrace.h"
 #include "GameBoyHeader.h"
 #include "GlobalDefines.h"
 #include "device/usbd.h"
@@ -40,6 +42,29 @@ static bool web_serial_connected = false;
 
 static uint8_t command_buffer[64];
 
+/*
+ * While a ROM stream is active every packet received is 64 bytes of ROM data
+ * (two chunks) instead of a command. The ROM banks are sent in order, so the
+ * bank and chunk follow from the number of packets received.
+ */
+#define ROM_STREAM_PACKET_SIZE 64
+#define ROM_STREAM_PACKETS_PER_BANK (GB_ROM_BANK_SIZE / ROM_STREAM_PACKET_SIZE)
+
+static bool rom_stream_active = false;
+static uint16_t rom_stream_ack_window = 0;
+static uint32_t rom_stream_packets = 0;
+
+/*
+ * When a stream ends with an error, the host may still have up to an ack
+ * window of packets in flight. They are thrown away until nothing has been
+ * received for ROM_STREAM_DRAIN_TIMEOUT_US, so ROM data is never parsed as
+ * commands.
+ */
+#define ROM_STREAM_DRAIN_TIMEOUT_US 200000U
+
+static bool rom_stream_draining = false;
+static uint32_t rom_stream_drain_last_us = 0;
+
 #define URL "croco.x-pantion.de"
 
 const tusb_desc_webusb_url_t desc_url = {.bLength = 3 + sizeof(URL) - 1,
@@ -62,6 +87,12 @@ static int handle_request_savegame_upload_command(uint8_t buff[63]);
 static int handle_savegame_received_chunk_command(uint8_t buff[63]);
 static int handle_rtc_download_command(uint8_t buff[63]);
 static int handle_rtc_upload_command(uint8_t buff[63]);
+static int handle_bus_trace_download_command(uint8_t buff[63]);
+static int handle_rom_stream_command(uint8_t buff[63]);
+static int handle_bank_crc_command(uint8_t buff[63]);
+static void rom_stream_task(void);
+static void rom_stream_drain_task(void);
+static void rom_stream_reset(void);
 
 void usb_start() { tusb_init(); }
 
@@ -74,7 +105,11 @@ void usb_run() {
 
 void webserial_task(void) {
   if (web_serial_connected) {
-    if (tud_vendor_available()) {
+    if (rom_stream_active) {
+      rom_stream_task();
+    } else if (rom_stream_draining) {
+      rom_stream_drain_task();
+    } else if (tud_vendor_available()) {
       uint8_t buf[1];
       uint32_t count = tud_vendor_read(buf, sizeof(buf));
       if (count) {
@@ -94,7 +129,7 @@ void webserial_task(void) {
 void tud_mount_cb(void) {}
 
 // Invoked when device is unmounted
-void tud_umount_cb(void) {}
+void tud_umount_cb(void) { rom_stream_reset(); }
 
 // Invoked when usb bus is suspended
 // remote_wakeup_en : if host allow us  to perform remote wakeup
@@ -152,6 +187,12 @@ bool tud_vendor_control_xfer_cb(uint8_t rhport, uint8_t stage,
       web_serial_connected = (request->wValue != 0);
       printf("web_serial_connected %d\n", web_serial_connected);
 
+      // a session closed in the middle of a stream must not leave the next
+      // one in stream mode
+      if (!web_serial_connected) {
+        rom_stream_reset();
+      }
+
       // response with status OK
       return tud_control_status(rhport, request);
     }
@@ -212,6 +253,15 @@ static void handle_command(uint8_t command) {
   case 11:
     response_length = handle_rtc_upload_command(&command_buffer[1]);
     break;
+  case 12:
+    response_length = handle_bus_trace_download_command(&command_buffer[1]);
+    break;
+  case 13:
+    response_length = handle_rom_stream_command(&command_buffer[1]);
+    break;
+  case 14:
+    response_length = handle_bank_crc_command(&command_buffer[1]);
+    break;
   case 253:
     response_length = handle_device_serial_id_command(&command_buffer[1]);
     break;
@@ -238,7 +288,7 @@ static void handle_command(uint8_t command) {
 
 static int handle_device_info_command(uint8_t buff[63]) {
   uint32_t git_sha1 = git_CommitSHA1Short();
-  buff[0] = 4; // featureStep
+  buff[0] = 6; // featureStep
   buff[1] = 1; // hwVersion
   buff[2] = RP2040_GB_CARTRIDGE_VERSION_MAJOR;
   buff[3] = RP2040_GB_CARTRIDGE_VERSION_MINOR;
@@ -508,3 +558,166 @@ static int handle_rtc_upload_command(uint8_t buff[63]) {
 
   return 1;
 }
+
+static int handle_bus_trace_download_command(uint8_t buff[63]) {
+  uint32_t first, total = 0;
+
+  uint32_t count = tud_vendor_read(buff, 4);
+  if (count != 4) {
+    printf("wrong number of bytes for bus trace command, got %u\n", count);
+    return -1;
+  }
+
+  first = (buff[0] << 24) + (buff[1] << 16) + (buff[2] << 8) + buff[3];
+
+  // 5 bytes header and 7 entries of 8 bytes fit into one packet
+  int entries = BusTrace_ReadEntries(first, &buff[5], 7, &total);
+  if (entries < 0) {
+    return -1;
+  }
+
+  buff[0] = (total >> 24) & 0xFF;
+  buff[1] = (total >> 16) & 0xFF;
+  buff[2] = (total >> 8) & 0xFF;
+  buff[3] = total & 0xFF;
+  buff[4] = entries;
+
+  return 5 + (entries * sizeof(struct BusTraceEntry));
+}
+
+/*
+ * Starts streaming the banks of the ROM announced with command 2. The host
+ * sends the ack window (number of packets between two acks) and then the
+ * ROM data in 64 byte packets without any framing. The ack is
+ * [13, status, packets received (4 bytes)] and is also sent when the ROM is
+ * complete or on errors (status 1), which end the stream. After an error the
+ * host has to stop sending for ROM_STREAM_DRAIN_TIMEOUT_US before the next
+ * command is accepted.
+ */
+static int handle_rom_stream_command(uint8_t buff[63]) {
+  uint32_t count = tud_vendor_read(buff, 2);
+  if (count != 2) {
+    printf("wrong number of bytes for rom stream command\n");
+    return -1;
+  }
+
+  rom_stream_ack_window = (buff[0] << 8) + buff[1];
+
+  buff[0] = 0;
+  if (!RomStorage_IsRomTransferActive() || (rom_stream_ack_window == 0)) {
+    buff[0] = 1;
+  } else {
+    rom_stream_packets = 0;
+    rom_stream_active = true;
+  }
+
+  return 1;
+}
+
+static void rom_stream_send_ack(uint8_t status) {
+  uint8_t ack[6];
+
+  ack[0] = 13;
+  ack[1] = status;
+  ack[2] = (rom_stream_packets >> 24) & 0xFF;
+  ack[3] = (rom_stream_packets >> 16) & 0xFF;
+  ack[4] = (rom_stream_packets >> 8) & 0xFF;
+  ack[5] = rom_stream_packets & 0xFF;
+
+  tud_vendor_write(ack, sizeof(ack));
+  tud_vendor_flush();
+}
+
+static void rom_stream_task(void) {
+  uint8_t packet[ROM_STREAM_PACKET_SIZE];
+
+  while (tud_vendor_available() >= ROM_STREAM_PACKET_SIZE) {
+    tud_vendor_read(packet, ROM_STREAM_PACKET_SIZE);
+
+    const uint16_t bank = rom_stream_packets / ROM_STREAM_PACKETS_PER_BANK;
+    const uint16_t chunk =
+        (rom_stream_packets % ROM_STREAM_PACKETS_PER_BANK) * 2;
+
+    if ((RomStorage_TransferRomChunk(bank, chunk, &packet[0]) < 0) ||
+        (RomStorage_TransferRomChunk(bank, chunk + 1, &packet[32]) < 0)) {
+      printf("rom stream aborted at packet %u\n", rom_stream_packets);
+      rom_stream_active = false;
+      rom_stream_draining = true;
+      rom_stream_drain_last_us = time_us_32();
+      RomStorage_AbortRomTransfer();
+      rom_stream_send_ack(1);
+      return;
+    }
+
+    rom_stream_packets++;
+
+    if (!RomStorage_IsRomTransferActive()) {
+      rom_stream_active = false;
+      rom_stream_send_ack(0);
+      return;
+    }
+
+    if ((rom_stream_packets % rom_stream_ack_window) == 0) {
+      rom_stream_send_ack(0);
+    }
+  }
+}
+
+static void rom_stream_drain_task(void) {
+  uint8_t packet[ROM_STREAM_PACKET_SIZE];
+
+  while (tud_vendor_available()) {
+    tud_vendor_read(packet, sizeof(packet));
+    rom_stream_drain_last_us = time_us_32();
+  }
+
+  if ((time_us_32() - rom_stream_drain_last_us) >=
+      ROM_STREAM_DRAIN_TIMEOUT_US) {
+    printf("rom stream drained\n");
+    rom_stream_draining = false;
+  }
+}
+
+/*
+ * Only a streamed transfer is aborted. A chunked upload (command 3) can be
+ * continued by the host after it reconnected.
+ */
+static void rom_stream_reset(void) {
+  if (rom_stream_active || rom_stream_draining) {
+    printf("rom stream reset at packet %u\n", rom_stream_packets);
+    RomStorage_AbortRomTransfer();
+  }
+
+  rom_stream_active = false;
+  rom_stream_draining = false;
+  rom_stream_packets = 0;
+}
+
+static int handle_bank_crc_command(uint8_t buff[63]) {
+  uint32_t crc = 0;
+
+  uint32_t count = tud_vendor_read(buff, 3);
+  if (count != 3) {
+    printf("wrong number of bytes for bank crc command\n");
+    return -1;
+  }
+
+  const uint8_t requestedRom = buff[0];
+  const uint16_t bank = (buff[1] << 8) + buff[2];
+
+  if (requestedRom >= g_numRoms) {
+    return -1;
+  }
+
+  buff[0] = 0;
+  if (RomStorage_GetBankCrc(requestedRom, bank, &crc) < 0) {
+    buff[0] = 1;
+  }
+
+  buff[1] = (crc >> 24) & 0xFF;
+  buff[2] = (crc >> 16) & 0xFF;
+  buff[3] = (crc >> 8) & 0xFF;
+  buff[4] = crc & 0xFF;
+
+  return 5;
+}